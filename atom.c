@@ -1,4 +1,5 @@
 #include "mrss.h"
+#include "trace.h"
 
 /* @see https://validator.w3.org/feed/docs/atom.html */
 
@@ -8,34 +9,28 @@ static xmlChar const NS_MEDIA[] = "http://search.yahoo.com/mrss/";
 static void
 atom_parse_authors(xmlNodePtr node, struct entry *e)
 {
-	struct entry_author *author = e->authors;
 	for eachXmlElement(child, node) {
 		if (!xmlTestNode(child, "author", NS_ATOM) &&
 		    !xmlTestNode(child, "contributor", NS_ATOM))
 			continue;
-		if (!ARRAY_IN(e->authors, author))
-			break;
 
-		author->name = xmlGetNsChildContent(child, "name", NS_ATOM);
-		author->email = xmlGetNsChildContent(child, "email", NS_ATOM);
-		++author;
+		entry_add_author(e,
+				xmlGetNsChildContent(child, "name", NS_ATOM),
+				xmlGetNsChildContent(child, "email", NS_ATOM));
 	}
 }
 
 static void
 atom_parse_categories(xmlNodePtr node, struct entry *e)
 {
-	struct entry_category *category = e->categories;
 	for eachXmlElement(child, node) {
 		if (!xmlTestNode(child, "category", NS_ATOM))
 			continue;
-		if (ARRAY_IN(e->categories, category))
-			break;
 
-		category->name = xmlGetNoNsProp(child, XML_CHAR "label");
-		if (!category->name)
-			category->name = xmlGetNoNsProp(child, XML_CHAR "term");
-		++category;
+		xmlChar *name = xmlGetNoNsProp(child, XML_CHAR "label");
+		if (!name)
+			name = xmlGetNoNsProp(child, XML_CHAR "term");
+		entry_add_category(e, name);
 	}
 }
 
@@ -60,6 +55,26 @@ atom_get_link(xmlNodePtr node)
 	return NULL;
 }
 
+static void
+atom_parse_images(xmlNodePtr node, struct entry *e)
+{
+	for eachXmlElement(child, node) {
+		if (xmlTestNode(child, "link", NS_ATOM)) {
+			xmlChar *rel = xmlGetNoNsProp(child, XML_CHAR "rel");
+			xmlChar *type = xmlGetNoNsProp(child, XML_CHAR "type");
+			if (!xmlStrcmp(rel, XML_CHAR "enclosure") &&
+			    !xmlStrncmp(type, XML_CHAR "image/", 6))
+				entry_add_image(e, xmlGetNoNsProp(child, XML_CHAR "href"));
+			xmlFree(rel);
+			xmlFree(type);
+		} else if (xmlTestNode(child, "thumbnail", NS_MEDIA)) {
+			entry_add_image(e, xmlGetNoNsProp(child, XML_CHAR "url"));
+		} else if (xmlTestNode(child, "group", NS_MEDIA)) {
+			atom_parse_images(child, e);
+		}
+	}
+}
+
 static struct media
 atom_get_text(xmlNodePtr node)
 {
@@ -101,8 +116,10 @@ atom_parse_entry(xmlNodePtr node, struct entry const *feed)
 		.text = text,
 		.feed = feed,
 	};
+	entry_track(&entry);
 	atom_parse_authors(node, &entry);
 	atom_parse_categories(node, &entry);
+	atom_parse_images(node, &entry);
 
 	entry_process(&entry);
 
@@ -115,6 +132,8 @@ atom_parse(xmlNodePtr node)
 	if (!xmlTestNode(node, "feed", NS_ATOM))
 		return 0;
 
+	TRACE_BEGIN("atom_parse");
+
 	struct entry feed = {
 		.id = xmlGetNsChildContent(node, "id", NS_ATOM),
 		.lang = xmlGetNsChildContent(node, "language", NS_ATOM),
@@ -123,6 +142,7 @@ atom_parse(xmlNodePtr node)
 		.text = atom_get_text(xmlGetNsChild(node, "description", NS_ATOM)),
 		.feed = NULL,
 	};
+	entry_track(&feed);
 	atom_parse_authors(node, &feed);
 	atom_parse_categories(node, &feed);
 
@@ -132,5 +152,7 @@ atom_parse(xmlNodePtr node)
 
 	entry_uninit(&feed);
 
+	TRACE_END();
+
 	return 1;
 }
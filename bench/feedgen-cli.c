@@ -0,0 +1,68 @@
+/*
+ * Synthetic feed generator.
+ *
+ * Usage: feedgen [OPTION=VALUE]...
+ *
+ * format=atom|rss|rdf  Feed format. Default: atom.
+ * entries=N            Number of entries. Default: 100.
+ * body=N               Approximate body size of an entry in bytes. Default: 1024.
+ * nonascii=N           Percentage of non-ASCII words in text. Default: 5.
+ * categories=N         Categories per entry. Default: 4.
+ * authors=N            Authors per entry. Default: 2.
+ * pool=N               Number of distinct categories and authors. Default: 64.
+ * seed=N               Random seed. Default: 1.
+ * date=N               UNIX time of the newest entry. Default: 1600000000.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "feedgen.h"
+
+int
+main(int argc, char *argv[])
+{
+	struct feedgen opts = FEEDGEN_DEFAULTS;
+
+	for (int i = 1; i < argc; ++i) {
+		char *value = strchr(argv[i], '=');
+		if (!value)
+			goto usage;
+		*value++ = '\0';
+
+		if (!strcmp(argv[i], "format")) {
+			if (!strcmp(value, "atom"))
+				opts.format = FEEDGEN_ATOM;
+			else if (!strcmp(value, "rss"))
+				opts.format = FEEDGEN_RSS;
+			else if (!strcmp(value, "rdf"))
+				opts.format = FEEDGEN_RDF;
+			else
+				goto usage;
+		} else if (!strcmp(argv[i], "entries"))
+			opts.nentries = atol(value);
+		else if (!strcmp(argv[i], "body"))
+			opts.body_size = atol(value);
+		else if (!strcmp(argv[i], "nonascii"))
+			opts.nonascii = atol(value);
+		else if (!strcmp(argv[i], "categories"))
+			opts.ncategories = atol(value);
+		else if (!strcmp(argv[i], "authors"))
+			opts.nauthors = atol(value);
+		else if (!strcmp(argv[i], "pool"))
+			opts.pool = atol(value);
+		else if (!strcmp(argv[i], "seed"))
+			opts.seed = strtoull(value, NULL, 10);
+		else if (!strcmp(argv[i], "date"))
+			opts.date = atoll(value);
+		else
+			goto usage;
+	}
+
+	feedgen_write(stdout, &opts);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [OPTION=VALUE]...\n", argv[0]);
+	return EXIT_FAILURE;
+}
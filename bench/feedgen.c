@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "feedgen.h"
+
+static char const *const WORDS[] = {
+	"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+	"elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+	"et", "dolore", "magna", "aliqua", "feed", "mail", "news", "update",
+};
+
+static char const *const NONASCII_WORDS[] = {
+	"árvíztűrő", "tükörfúrógép", "Größe", "naïve", "café", "Ærøskøbing",
+	"żółć", "Ελλάδα", "данные", "日本語", "☃", "€",
+};
+
+#define ARRAY_SIZE(a) (sizeof a / sizeof *a)
+
+struct gen {
+	FILE *out;
+	struct feedgen const *opts;
+	unsigned long long seed;
+};
+
+static unsigned long long
+rnd(struct gen *g)
+{
+	/* xorshift64* */
+	g->seed ^= g->seed >> 12;
+	g->seed ^= g->seed << 25;
+	g->seed ^= g->seed >> 27;
+	return g->seed * 0x2545f4914f6cdd1dULL;
+}
+
+static unsigned long long
+rnd_pool(struct gen *g)
+{
+	return rnd(g) % (0 < g->opts->pool ? g->opts->pool : 1);
+}
+
+static void
+put_text(struct gen *g, long size)
+{
+	for (long n = 0; n < size;) {
+		char const *word = (long)(rnd(g) % 100) < g->opts->nonascii
+			? NONASCII_WORDS[rnd(g) % ARRAY_SIZE(NONASCII_WORDS)]
+			: WORDS[rnd(g) % ARRAY_SIZE(WORDS)];
+		if (n)
+			fputc(' ', g->out);
+		fputs(word, g->out);
+		n += strlen(word) + 1;
+	}
+}
+
+/* Escaped HTML body. */
+static void
+put_body(struct gen *g)
+{
+	long size = g->opts->body_size;
+	long paragraph = 256 < size ? 256 : size;
+	for (long n = 0; n < size; n += paragraph) {
+		fputs("&lt;p&gt;", g->out);
+		put_text(g, paragraph);
+		fputs("&lt;/p&gt;", g->out);
+	}
+}
+
+static void
+put_date(struct gen *g, long i, char const *fmt)
+{
+	time_t t = g->opts->date - i * 3600;
+	char buf[64];
+	strftime(buf, sizeof buf, fmt, gmtime(&t));
+	fputs(buf, g->out);
+}
+
+static void
+put_atom(struct gen *g)
+{
+	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	      "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n"
+	      "<id>urn:feedgen</id>\n"
+	      "<title>Generated Atom feed</title>\n"
+	      "<link href=\"http://feedgen.example/\"/>\n", g->out);
+	for (long i = 0; i < g->opts->nentries; ++i) {
+		fprintf(g->out, "<entry>\n<id>urn:feedgen:%ld</id>\n<title>", i);
+		put_text(g, 40);
+		fprintf(g->out, "</title>\n<link href=\"http://feedgen.example/%ld\"/>\n<updated>", i);
+		put_date(g, i, "%FT%TZ");
+		fputs("</updated>\n", g->out);
+		for (long j = 0; j < g->opts->nauthors; ++j)
+			fprintf(g->out, "<author><name>Author %llu</name><email>a%llu@feedgen.example</email></author>\n",
+					rnd_pool(g), rnd_pool(g));
+		for (long j = 0; j < g->opts->ncategories; ++j)
+			fprintf(g->out, "<category term=\"category-%llu\"/>\n", rnd_pool(g));
+		fputs("<content type=\"html\">", g->out);
+		put_body(g);
+		fputs("</content>\n</entry>\n", g->out);
+	}
+	fputs("</feed>\n", g->out);
+}
+
+static void
+put_rss(struct gen *g)
+{
+	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	      "<rss version=\"2.0\">\n"
+	      "<channel>\n"
+	      "<title>Generated RSS feed</title>\n"
+	      "<link>http://feedgen.example/</link>\n"
+	      "<description>Generated</description>\n"
+	      "<language>en</language>\n", g->out);
+	for (long i = 0; i < g->opts->nentries; ++i) {
+		fputs("<item>\n<title>", g->out);
+		put_text(g, 40);
+		fprintf(g->out, "</title>\n<link>http://feedgen.example/%ld</link>\n"
+		                "<guid>http://feedgen.example/%ld</guid>\n<pubDate>", i, i);
+		put_date(g, i, "%a, %d %b %Y %T GMT");
+		fputs("</pubDate>\n", g->out);
+		for (long j = 0; j < g->opts->nauthors; ++j)
+			fprintf(g->out, "<author>a%llu@feedgen.example (Author)</author>\n", rnd_pool(g));
+		for (long j = 0; j < g->opts->ncategories; ++j)
+			fprintf(g->out, "<category>category-%llu</category>\n", rnd_pool(g));
+		fputs("<description>", g->out);
+		put_body(g);
+		fputs("</description>\n</item>\n", g->out);
+	}
+	fputs("</channel>\n</rss>\n", g->out);
+}
+
+static void
+put_rdf(struct gen *g)
+{
+	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	      "<rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\""
+	      " xmlns=\"http://purl.org/rss/1.0/\""
+	      " xmlns:dc=\"http://purl.org/dc/elements/1.1/\">\n"
+	      "<channel rdf:about=\"http://feedgen.example/\">\n"
+	      "<title>Generated RDF feed</title>\n"
+	      "<link>http://feedgen.example/</link>\n"
+	      "<description>Generated</description>\n"
+	      "<items><rdf:Seq>\n", g->out);
+	for (long i = 0; i < g->opts->nentries; ++i)
+		fprintf(g->out, "<rdf:li rdf:resource=\"http://feedgen.example/%ld\"/>\n", i);
+	fputs("</rdf:Seq></items>\n</channel>\n", g->out);
+	for (long i = 0; i < g->opts->nentries; ++i) {
+		fprintf(g->out, "<item rdf:about=\"http://feedgen.example/%ld\">\n<title>", i);
+		put_text(g, 40);
+		fprintf(g->out, "</title>\n<link>http://feedgen.example/%ld</link>\n<dc:date>", i);
+		put_date(g, i, "%FT%TZ");
+		fputs("</dc:date>\n<description>", g->out);
+		put_body(g);
+		fputs("</description>\n</item>\n", g->out);
+	}
+	fputs("</rdf:RDF>\n", g->out);
+}
+
+void
+feedgen_write(FILE *stream, struct feedgen const *opts)
+{
+	struct gen g = {
+		.out = stream,
+		.opts = opts,
+		.seed = opts->seed ? opts->seed : 1,
+	};
+
+	switch (opts->format) {
+	case FEEDGEN_ATOM: put_atom(&g); break;
+	case FEEDGEN_RSS: put_rss(&g); break;
+	case FEEDGEN_RDF: put_rdf(&g); break;
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef MRSS_FEEDGEN_H
+#define MRSS_FEEDGEN_H
+
+#include <stdio.h>
+
+enum feedgen_format {
+	FEEDGEN_ATOM,
+	FEEDGEN_RSS,
+	FEEDGEN_RDF,
+};
+
+struct feedgen {
+	enum feedgen_format format;
+	long nentries;
+	/* Approximate body size of an entry in bytes. */
+	long body_size;
+	/* Percentage of non-ASCII words. */
+	long nonascii;
+	long ncategories;
+	long nauthors;
+	/* Number of distinct categories and authors. */
+	long pool;
+	unsigned long long seed;
+	/* Newest entry date. */
+	long long date;
+};
+
+#define FEEDGEN_DEFAULTS (struct feedgen){ \
+	.format = FEEDGEN_ATOM, \
+	.nentries = 100, \
+	.body_size = 1024, \
+	.nonascii = 5, \
+	.ncategories = 4, \
+	.nauthors = 2, \
+	.pool = 64, \
+	.seed = 1, \
+	.date = 1600000000, \
+}
+
+/* Output is deterministic for the same options. */
+void feedgen_write(FILE *stream, struct feedgen const *opts);
+
+#endif
@@ -0,0 +1,534 @@
+/*
+ * HTTP server serving synthetic feeds for load testing.
+ *
+ * Usage: httpd [OPTION=VALUE]...
+ *
+ * port=N          Listen on 127.0.0.1:N. Default: 0 (any free port).
+ * port_file=PATH  Write port number into PATH once listening.
+ * feeds=N         Serve /feed/0.xml ... /feed/(N-1).xml. Default: 1000.
+ * entries=N       Entries per feed. Default: 20.
+ * body=N          Body size of entries. Default: 1024.
+ * latency=MS      Delay before responding. Default: 0.
+ * jitter=MS       Random additional delay. Default: 0.
+ * bandwidth=N     Bytes per second per connection. Default: 0 (unlimited).
+ * errors=N        Percentage of requests answered with 429 or 503. Default: 0.
+ * log=PATH        Access log: PATH STATUS BYTES MILLISECONDS.
+ * seed=N          Random seed. Default: 1.
+ *
+ * Feeds are generated at startup. Every feed has a fixed ETag and
+ * Last-Modified date, conditional requests are answered with 304. Bodies
+ * are gzip compressed if client accepts it.
+ *
+ * /image/N.png is the same small image for every N, with ETag "image".
+ */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "feedgen.h"
+
+#define MAX_CONNS 512
+
+struct feed {
+	char *body;
+	size_t body_size;
+	char *gzip;
+	size_t gzip_size;
+	char etag[32];
+	time_t last_modified;
+};
+
+struct conn {
+	int fd;
+	char req[8192];
+	size_t req_size;
+	/* Response. */
+	int responding;
+	char head[1024];
+	size_t head_size;
+	char const *body;
+	size_t body_size;
+	size_t sent;
+	int keep_alive;
+	int status;
+	char path[256];
+	long long start_us;
+	long long ready_us;
+};
+
+static long opt_port;
+static char const *opt_port_file;
+static long opt_feeds = 1000;
+static long opt_entries = 20;
+static long opt_body = 1024;
+static long opt_latency;
+static long opt_jitter;
+static long opt_bandwidth;
+static long opt_errors;
+static FILE *access_log;
+static unsigned long long seed = 1;
+
+static struct feed *feeds;
+static struct conn conns[MAX_CONNS];
+static size_t nconns;
+
+static unsigned long long
+rnd(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545f4914f6cdd1dULL;
+}
+
+static long long
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+die(char const *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void
+gzip_body(struct feed *feed)
+{
+	z_stream z = { 0 };
+	if (Z_OK != deflateInit2(&z, Z_BEST_SPEED, Z_DEFLATED,
+				15 + 16 /* gzip */, 8, Z_DEFAULT_STRATEGY))
+		die("deflateInit2");
+
+	feed->gzip_size = deflateBound(&z, feed->body_size);
+	feed->gzip = malloc(feed->gzip_size);
+	if (!feed->gzip)
+		die("malloc");
+
+	z.next_in = (unsigned char *)feed->body;
+	z.avail_in = feed->body_size;
+	z.next_out = (unsigned char *)feed->gzip;
+	z.avail_out = feed->gzip_size;
+	if (Z_STREAM_END != deflate(&z, Z_FINISH))
+		die("deflate");
+	feed->gzip_size = z.total_out;
+	deflateEnd(&z);
+}
+
+static void
+generate_feeds(void)
+{
+	feeds = calloc(opt_feeds, sizeof *feeds);
+	if (!feeds)
+		die("calloc");
+
+	for (long i = 0; i < opt_feeds; ++i) {
+		struct feed *feed = &feeds[i];
+		struct feedgen opts = FEEDGEN_DEFAULTS;
+		opts.format = i % 3;
+		opts.nentries = opt_entries;
+		opts.body_size = opt_body;
+		opts.seed = i + 1;
+
+		FILE *stream = open_memstream(&feed->body, &feed->body_size);
+		if (!stream)
+			die("open_memstream");
+		feedgen_write(stream, &opts);
+		fclose(stream);
+
+		gzip_body(feed);
+		sprintf(feed->etag, "\"feed-%ld\"", i);
+		feed->last_modified = opts.date;
+	}
+}
+
+static char const *
+get_header(struct conn *c, char const *name)
+{
+	size_t len = strlen(name);
+	for (char const *s = strstr(c->req, "\r\n"); s; s = strstr(s, "\r\n")) {
+		s += 2;
+		if (!strncasecmp(s, name, len) && ':' == s[len]) {
+			s += len + 1;
+			while (' ' == *s || '\t' == *s)
+				++s;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static int
+header_equals(char const *value, char const *s)
+{
+	size_t len = strlen(s);
+	return value && !strncmp(value, s, len) && '\r' == value[len];
+}
+
+static void
+respond(struct conn *c, int status, char const *headers,
+		char const *body, size_t body_size)
+{
+	static char const *const REASONS[600] = {
+		[200] = "OK",
+		[304] = "Not Modified",
+		[400] = "Bad Request",
+		[404] = "Not Found",
+		[429] = "Too Many Requests",
+		[503] = "Service Unavailable",
+	};
+
+	c->status = status;
+	c->body = body;
+	c->body_size = body_size;
+	c->head_size = snprintf(c->head, sizeof c->head,
+			"HTTP/1.1 %d %s\r\n"
+			"Content-Length: %zu\r\n"
+			"%s"
+			"%s"
+			"\r\n",
+			status, REASONS[status],
+			body_size,
+			c->keep_alive ? "" : "Connection: close\r\n",
+			headers);
+	c->sent = 0;
+	c->responding = 1;
+
+	c->ready_us = c->start_us + opt_latency * 1000;
+	if (opt_jitter)
+		c->ready_us += rnd() % (opt_jitter * 1000);
+}
+
+static void
+respond_image(struct conn *c)
+{
+	/* 1x1 transparent PNG. */
+	static char const IMAGE[] =
+		"\x89PNG\r\n\x1a\n\0\0\0\rIHDR\0\0\0\x01\0\0\0\x01\x08\x06\0\0\0"
+		"\x1f\x15\xc4\x89\0\0\0\rIDATx\x9c" "c\0\x01\0\0\x05\0\x01\x0d\n-\xb4"
+		"\0\0\0\0IEND\xae\x42\x60\x82";
+	static char const HEADERS[] =
+		"ETag: \"image\"\r\n"
+		"Content-Type: image/png\r\n";
+
+	if (header_equals(get_header(c, "If-None-Match"), "\"image\""))
+		respond(c, 304, HEADERS, "", 0);
+	else
+		respond(c, 200, HEADERS, IMAGE, sizeof IMAGE - 1);
+}
+
+static void
+handle_request(struct conn *c)
+{
+	c->start_us = now_us();
+
+	char method[16];
+	if (2 != sscanf(c->req, "%15s %255s", method, c->path)) {
+		strcpy(c->path, "-");
+		c->keep_alive = 0;
+		respond(c, 400, "", "", 0);
+		return;
+	}
+
+	char const *connection = get_header(c, "Connection");
+	c->keep_alive = !(connection && !strncasecmp(connection, "close", 5));
+
+	long i;
+	int n;
+	if (1 == sscanf(c->path, "/image/%ld.png%n", &i, &n) &&
+	    (!c->path[n] || '?' == c->path[n]))
+	{
+		respond_image(c);
+		return;
+	}
+
+	if (1 != sscanf(c->path, "/feed/%ld.xml%n", &i, &n) ||
+	    c->path[n] ||
+	    i < 0 || opt_feeds <= i)
+	{
+		respond(c, 404, "", "", 0);
+		return;
+	}
+
+	if ((long)(rnd() % 100) < opt_errors) {
+		respond(c, rnd() % 2 ? 429 : 503, "Retry-After: 1\r\n", "", 0);
+		return;
+	}
+
+	struct feed const *feed = &feeds[i];
+
+	char last_modified[64];
+	strftime(last_modified, sizeof last_modified,
+			"%a, %d %b %Y %T GMT", gmtime(&feed->last_modified));
+
+	char headers[256];
+	int gzip = !!strstr(get_header(c, "Accept-Encoding") ?: "", "gzip");
+	snprintf(headers, sizeof headers,
+			"ETag: %s\r\n"
+			"Last-Modified: %s\r\n"
+			"Content-Type: application/xml\r\n"
+			"%s",
+			feed->etag, last_modified,
+			gzip ? "Content-Encoding: gzip\r\n" : "");
+
+	char const *if_none_match = get_header(c, "If-None-Match");
+	char const *if_modified_since = get_header(c, "If-Modified-Since");
+	if (if_none_match
+	    ? header_equals(if_none_match, feed->etag)
+	    : header_equals(if_modified_since, last_modified))
+	{
+		respond(c, 304, headers, "", 0);
+		return;
+	}
+
+	if (gzip)
+		respond(c, 200, headers, feed->gzip, feed->gzip_size);
+	else
+		respond(c, 200, headers, feed->body, feed->body_size);
+}
+
+static void
+conn_close(struct conn *c)
+{
+	close(c->fd);
+	*c = conns[--nconns];
+}
+
+/* Returns when it should be called again or 0. */
+static long long
+conn_write(struct conn *c, long long now)
+{
+	if (now < c->ready_us)
+		return c->ready_us;
+
+	size_t total = c->head_size + c->body_size;
+	size_t allowed = total;
+	if (opt_bandwidth) {
+		long long elapsed = now - c->ready_us;
+		allowed = c->head_size + elapsed * opt_bandwidth / 1000000 + 4096;
+		if (total < allowed)
+			allowed = total;
+		if (allowed <= c->sent)
+			return now + 4096 * 1000000LL / opt_bandwidth;
+	}
+
+	while (c->sent < allowed) {
+		char const *p;
+		size_t n;
+		if (c->sent < c->head_size) {
+			p = c->head + c->sent;
+			n = c->head_size - c->sent;
+		} else {
+			p = c->body + (c->sent - c->head_size);
+			n = allowed - c->sent;
+		}
+
+		ssize_t rc = send(c->fd, p, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc < 0) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno)
+				return 0;
+			c->keep_alive = 0;
+			c->sent = total;
+			break;
+		}
+		c->sent += rc;
+	}
+
+	if (c->sent < total)
+		return allowed < total ? now + 1000 : 0;
+
+	if (access_log)
+		fprintf(access_log, "%s %d %zu %.3f\n",
+				c->path, c->status, c->body_size,
+				(now_us() - c->start_us) / 1000.);
+
+	c->responding = 0;
+	return -1;
+}
+
+static void
+parse_opts(int argc, char *argv[])
+{
+	static struct {
+		char const *name;
+		long *value;
+	} const LONG_OPTS[] = {
+		{ "port", &opt_port },
+		{ "feeds", &opt_feeds },
+		{ "entries", &opt_entries },
+		{ "body", &opt_body },
+		{ "latency", &opt_latency },
+		{ "jitter", &opt_jitter },
+		{ "bandwidth", &opt_bandwidth },
+		{ "errors", &opt_errors },
+	};
+
+	for (int i = 1; i < argc; ++i) {
+		char *value = strchr(argv[i], '=');
+		if (!value)
+			goto usage;
+		*value++ = '\0';
+
+		if (!strcmp(argv[i], "port_file")) {
+			opt_port_file = value;
+			continue;
+		} else if (!strcmp(argv[i], "log")) {
+			access_log = fopen(value, "w");
+			if (!access_log)
+				die(value);
+			setvbuf(access_log, NULL, _IOLBF, 0);
+			continue;
+		} else if (!strcmp(argv[i], "seed")) {
+			seed = strtoull(value, NULL, 10) ?: 1;
+			continue;
+		}
+
+		size_t j = 0;
+		while (j < sizeof LONG_OPTS / sizeof *LONG_OPTS &&
+		       strcmp(argv[i], LONG_OPTS[j].name))
+			++j;
+		if (sizeof LONG_OPTS / sizeof *LONG_OPTS == j)
+			goto usage;
+		*LONG_OPTS[j].value = atol(value);
+	}
+	return;
+
+usage:
+	fprintf(stderr, "Usage: %s [OPTION=VALUE]...\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+static int
+listen_tcp(void)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		die("socket");
+
+	int yes = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(opt_port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t addr_size = sizeof addr;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+	    listen(fd, 128) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&addr, &addr_size) < 0)
+		die("listen");
+
+	if (opt_port_file) {
+		char tmp[4096];
+		snprintf(tmp, sizeof tmp, "%s~", opt_port_file);
+		FILE *f = fopen(tmp, "w");
+		if (!f)
+			die(tmp);
+		fprintf(f, "%d\n", ntohs(addr.sin_port));
+		if (fclose(f) || rename(tmp, opt_port_file))
+			die(opt_port_file);
+	}
+
+	return fd;
+}
+
+int
+main(int argc, char *argv[])
+{
+	parse_opts(argc, argv);
+	generate_feeds();
+	int lfd = listen_tcp();
+
+	struct pollfd pfds[1 + MAX_CONNS];
+	for (;;) {
+		long long now = now_us();
+		long long wakeup = 0;
+
+		pfds[0] = (struct pollfd){
+			.fd = nconns < MAX_CONNS ? lfd : -1,
+			.events = POLLIN,
+		};
+		for (size_t i = 0; i < nconns; ++i) {
+			struct conn *c = &conns[i];
+			short events = POLLIN;
+			if (c->responding) {
+				long long t = conn_write(c, now);
+				if (0 < t) {
+					events = 0;
+					if (!wakeup || t < wakeup)
+						wakeup = t;
+				} else if (!t) {
+					events = POLLOUT;
+				} else if (!c->keep_alive) {
+					conn_close(c--);
+					continue;
+				}
+			}
+			pfds[1 + i] = (struct pollfd){
+				.fd = c->fd,
+				.events = events,
+			};
+		}
+
+		int timeout = wakeup ? (int)((wakeup - now + 999) / 1000) : -1;
+		if (poll(pfds, 1 + nconns, timeout) < 0) {
+			if (EINTR == errno)
+				continue;
+			die("poll");
+		}
+
+		if (POLLIN & pfds[0].revents) {
+			int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (0 <= fd)
+				conns[nconns++] = (struct conn){ .fd = fd };
+		}
+
+		for (size_t i = nconns; 0 < i--;) {
+			struct conn *c = &conns[i];
+			if (c->fd != pfds[1 + i].fd ||
+			    !((POLLIN | POLLHUP | POLLERR) & pfds[1 + i].revents) ||
+			    c->responding)
+				continue;
+
+			ssize_t n = recv(c->fd, c->req + c->req_size,
+					sizeof c->req - 1 - c->req_size, 0);
+			if (n <= 0) {
+				if (n < 0 && EAGAIN == errno)
+					continue;
+				conn_close(c);
+				continue;
+			}
+			c->req_size += n;
+			c->req[c->req_size] = '\0';
+
+			char *end = strstr(c->req, "\r\n\r\n");
+			if (!end) {
+				if (sizeof c->req - 1 <= c->req_size)
+					conn_close(c);
+				continue;
+			}
+
+			/* Pipelined requests are not supported. */
+			end[2] = '\0';
+			handle_request(c);
+			c->req_size = 0;
+		}
+	}
+}
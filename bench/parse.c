@@ -0,0 +1,76 @@
+/*
+ * Parse feeds without rendering mails.
+ *
+ * Usage: bench-parse REPEAT FILE...
+ *
+ * Prints number of parsed entries.
+ */
+#include <libxml/parser.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "mrss.h"
+
+static unsigned long nentries;
+
+void
+msg(int priority, char const *format, ...)
+{
+	if (LOG_ERR < priority)
+		return;
+
+	va_list ap;
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+void
+entry_process(struct entry const *entry)
+{
+	(void)entry;
+	++nentries;
+}
+
+static void
+parse_file(char const *pathname)
+{
+	xmlDocPtr doc = xmlReadFile(pathname, NULL, 0);
+	if (!doc) {
+		fprintf(stderr, "%s: Invalid XML\n", pathname);
+		exit(EXIT_FAILURE);
+	}
+
+	xmlNodePtr root = xmlDocGetRootElement(doc);
+	if (!atom_parse(root) &&
+	    !rss_parse(root) &&
+	    !rdf_parse(root))
+	{
+		fprintf(stderr, "%s: Unexpected root node\n", pathname);
+		exit(EXIT_FAILURE);
+	}
+
+	xmlFreeDoc(doc);
+}
+
+int
+main(int argc, char *argv[])
+{
+	LIBXML_TEST_VERSION;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s REPEAT FILE...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (long n = atol(argv[1]); 0 < n; --n)
+		for (int i = 2; i < argc; ++i)
+			parse_file(argv[i]);
+
+	printf("%lu\n", nentries);
+	return EXIT_SUCCESS;
+}
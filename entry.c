@@ -0,0 +1,199 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "mrss.h"
+
+/* Resources of the feed being processed, innermost last. */
+static struct {
+	void (*release)(void *);
+	void *data;
+} tracked[32];
+static size_t ntracked;
+
+/*
+ * Strings of the current feed. Equal strings are the same pointer, so
+ * feed and entry sets can be compared by address.
+ */
+static xmlDictPtr dict;
+
+void
+feed_track(void (*release)(void *), void *data)
+{
+	/* Nesting is static so it cannot run out. */
+	if (!ARRAY_IN(tracked, &tracked[ntracked]))
+		abort();
+	tracked[ntracked].release = release;
+	tracked[ntracked].data = data;
+	++ntracked;
+}
+
+void
+feed_untrack(void *data)
+{
+	for (size_t i = ntracked; 0 < i--;)
+		if (tracked[i].data == data) {
+			memmove(&tracked[i], &tracked[i + 1],
+					(--ntracked - i) * sizeof *tracked);
+			return;
+		}
+}
+
+void
+feed_release(void)
+{
+	while (ntracked) {
+		--ntracked;
+		tracked[ntracked].release(tracked[ntracked].data);
+	}
+}
+
+static void
+entry_release(void *e)
+{
+	entry_uninit(e);
+}
+
+void
+entry_track(struct entry *e)
+{
+	feed_track(entry_release, e);
+}
+
+static xmlChar const *
+intern(xmlChar *s)
+{
+	if (!s)
+		return NULL;
+
+	if (!dict)
+		dict = xmlDictCreate();
+	xmlChar const *ret = dict ? xmlDictLookup(dict, s, -1) : NULL;
+	xmlFree(s);
+	if (!ret)
+		msg(LOG_ERR, "Cannot allocate memory");
+	return ret;
+}
+
+static size_t *
+strset_find(struct strset const *set, xmlChar const *s)
+{
+	size_t mask = 2 * set->alloc - 1;
+	size_t i = ((uint64_t)(uintptr_t)s * 0x9e3779b97f4a7c15) >> 32;
+	for (;; i = (i + 1) & mask) {
+		size_t *slot = &set->index[i & mask];
+		if (!*slot || set->items[*slot - 1] == s)
+			return slot;
+	}
+}
+
+static void
+strset_grow(struct strset *set)
+{
+	size_t n = set->alloc ? 2 * set->alloc : 16;
+	xmlChar const **p = realloc(set->items, n * sizeof *p);
+	if (!p)
+		msg(LOG_ERR, "Cannot allocate memory");
+	set->items = p;
+
+	/* Keep it at most half full. */
+	size_t *index = calloc(2 * n, sizeof *index);
+	if (!index)
+		msg(LOG_ERR, "Cannot allocate memory");
+	free(set->index);
+	set->index = index;
+	set->alloc = n;
+
+	for (size_t i = 0; i < set->n; ++i)
+		*strset_find(set, set->items[i]) = i + 1;
+}
+
+/* Return whether s was not yet in set. */
+static int
+strset_add(struct strset *set, xmlChar const *s)
+{
+	if (set->alloc <= set->n)
+		strset_grow(set);
+
+	size_t *slot = strset_find(set, s);
+	if (*slot)
+		return 0;
+	set->items[set->n++] = s;
+	*slot = set->n;
+	return 1;
+}
+
+int
+strset_has(struct strset const *set, xmlChar const *s)
+{
+	return set->alloc && *strset_find(set, s);
+}
+
+static void
+strset_free(struct strset *set)
+{
+	free(set->items);
+	free(set->index);
+}
+
+void
+entry_add_author(struct entry *e, xmlChar *name, xmlChar *email)
+{
+	xmlChar const *iname = intern(name);
+	xmlChar const *iemail = intern(email);
+	if (!iname)
+		return;
+
+	size_t alloc = e->authors.alloc;
+	int added = strset_add(&e->authors, iname);
+	/* Set may grow even if name is already in it. */
+	if (alloc != e->authors.alloc) {
+		xmlChar const **p = realloc(e->emails, e->authors.alloc * sizeof *p);
+		if (!p)
+			msg(LOG_ERR, "Cannot allocate memory");
+		e->emails = p;
+	}
+	if (added)
+		e->emails[e->authors.n - 1] = iemail;
+}
+
+void
+entry_add_category(struct entry *e, xmlChar *name)
+{
+	xmlChar const *iname = intern(name);
+	if (iname)
+		strset_add(&e->categories, iname);
+}
+
+void
+entry_add_image(struct entry *e, xmlChar *url)
+{
+	xmlChar const *iurl = intern(url);
+	if (iurl)
+		strset_add(&e->images, iurl);
+}
+
+void
+entry_uninit(struct entry *e)
+{
+	feed_untrack(e);
+
+	strset_free(&e->authors);
+	free(e->emails);
+	strset_free(&e->categories);
+	strset_free(&e->images);
+
+	/* Entries of the feed are already gone. */
+	if (!e->feed && dict) {
+		xmlDictFree(dict);
+		dict = NULL;
+	}
+
+	xmlFree(e->date);
+	xmlFree(e->id);
+	xmlFree(e->lang);
+	xmlFree(e->link);
+	xmlFree(e->subject);
+	xmlFree(e->text.content);
+}
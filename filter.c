@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "mrss.h"
+
+/*
+ * Patterns of all rules are compiled into a single Aho-Corasick automaton
+ * whose transitions are completed, so matching a field is one table lookup
+ * per byte however many rules there are. ASCII letters match regardless of
+ * case.
+ */
+
+/* No rule matches. */
+#define NO_RULE UINT32_MAX
+
+struct rule {
+	enum filter_field field;
+	char *pattern;
+	/* NULL to drop. */
+	char *folder;
+};
+
+struct state {
+	uint32_t next[256];
+	/* First rule whose pattern ends here, by field. */
+	uint32_t match[FILTER_NFIELDS];
+};
+
+static struct rule *rules;
+static size_t nrules;
+static size_t rules_alloc;
+
+static struct state *states;
+static size_t nstates;
+static size_t states_alloc;
+/* Rules were added since the automaton was built. */
+static int dirty;
+
+static unsigned char
+fold(unsigned char c)
+{
+	return 'A' <= c && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+static char *
+xstrdup(char const *s)
+{
+	char *ret = strdup(s);
+	if (!ret)
+		msg(LOG_ERR, "Cannot allocate memory");
+	return ret;
+}
+
+void
+filter_add(enum filter_field field, char const *pattern, char const *folder)
+{
+	if (rules_alloc <= nrules) {
+		size_t n = rules_alloc ? 2 * rules_alloc : 16;
+		struct rule *p = realloc(rules, n * sizeof *p);
+		if (!p)
+			msg(LOG_ERR, "Cannot allocate memory");
+		rules = p;
+		rules_alloc = n;
+	}
+
+	struct rule *rule = &rules[nrules];
+	rule->field = field;
+	rule->pattern = xstrdup(pattern);
+	rule->folder = folder ? xstrdup(folder) : NULL;
+	++nrules;
+	dirty = 1;
+}
+
+static uint32_t
+state_new(void)
+{
+	if (states_alloc <= nstates) {
+		size_t n = states_alloc ? 2 * states_alloc : 64;
+		struct state *p = realloc(states, n * sizeof *p);
+		if (!p)
+			msg(LOG_ERR, "Cannot allocate memory");
+		states = p;
+		states_alloc = n;
+	}
+
+	struct state *s = &states[nstates];
+	memset(s->next, 0, sizeof s->next);
+	for (size_t f = 0; f < FILTER_NFIELDS; ++f)
+		s->match[f] = NO_RULE;
+	return nstates++;
+}
+
+void
+filter_compile(void)
+{
+	if (!dirty)
+		return;
+
+	nstates = 0;
+	state_new();
+
+	/* Trie of patterns. Root is never a child, so 0 means no edge. */
+	for (uint32_t i = 0; i < nrules; ++i) {
+		uint32_t s = 0;
+		for (unsigned char const *c = (void *)rules[i].pattern; *c; ++c) {
+			uint32_t t = states[s].next[fold(*c)];
+			if (!t) {
+				t = state_new();
+				states[s].next[fold(*c)] = t;
+			}
+			s = t;
+		}
+		uint32_t *match = &states[s].match[rules[i].field];
+		if (i < *match)
+			*match = i;
+	}
+
+	/* Breadth-first, so failure states are complete before use. */
+	uint32_t *fail = malloc(nstates * sizeof *fail);
+	uint32_t *queue = malloc(nstates * sizeof *queue);
+	if (!fail || !queue) {
+		free(fail);
+		free(queue);
+		msg(LOG_ERR, "Cannot allocate memory");
+	}
+
+	size_t head = 0, tail = 0;
+	for (size_t c = 0; c < 256; ++c) {
+		uint32_t t = states[0].next[c];
+		if (t) {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+
+	while (head < tail) {
+		uint32_t s = queue[head++];
+		struct state *st = &states[s];
+		struct state const *f = &states[fail[s]];
+
+		for (size_t i = 0; i < FILTER_NFIELDS; ++i)
+			if (f->match[i] < st->match[i])
+				st->match[i] = f->match[i];
+
+		for (size_t c = 0; c < 256; ++c) {
+			uint32_t t = st->next[c];
+			if (t) {
+				fail[t] = f->next[c];
+				queue[tail++] = t;
+			} else {
+				st->next[c] = f->next[c];
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+	dirty = 0;
+}
+
+static uint32_t
+match(uint32_t best, enum filter_field field, xmlChar const *s)
+{
+	if (!s)
+		return best;
+
+	uint32_t state = 0;
+	for (; *s; ++s) {
+		state = states[state].next[fold(*s)];
+		if (states[state].match[field] < best)
+			best = states[state].match[field];
+	}
+	return best;
+}
+
+size_t
+filter_count(void)
+{
+	return nrules;
+}
+
+int
+filter_match(struct entry const *entry, char const **folder)
+{
+	if (!nrules)
+		return 0;
+
+	uint32_t best = NO_RULE;
+	best = match(best, FILTER_SUBJECT, entry->subject);
+	best = match(best, FILTER_LINK, entry->link);
+	best = match(best, FILTER_LANG, entry->lang);
+	for (size_t i = 0; i < entry->authors.n; ++i) {
+		best = match(best, FILTER_AUTHOR, entry->authors.items[i]);
+		best = match(best, FILTER_AUTHOR, entry->emails[i]);
+	}
+	for (size_t i = 0; i < entry->categories.n; ++i)
+		best = match(best, FILTER_CATEGORY, entry->categories.items[i]);
+
+	if (NO_RULE == best)
+		return 0;
+	*folder = rules[best].folder;
+	return 1;
+}
+
+void
+filter_free(void)
+{
+	for (size_t i = 0; i < nrules; ++i) {
+		free(rules[i].pattern);
+		free(rules[i].folder);
+	}
+	free(rules);
+	rules = NULL;
+	nrules = 0;
+	rules_alloc = 0;
+	dirty = 0;
+
+	free(states);
+	states = NULL;
+	nstates = 0;
+	states_alloc = 0;
+}
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+
+#include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mrss.h"
+#include "sha1.h"
+
+/*
+ * Cache is a directory of images named by the hash of their content and
+ * "url.HASH" records named by the hash of the URL they were fetched from.
+ */
+
+/* Larger images are left remote. */
+#define MAX_IMAGE_SIZE (4 << 20)
+
+#define MAX_TRANSFERS 8
+
+/* Lines of "url.HASH". */
+struct record {
+	time_t checked;
+	char etag[256];
+	char last_modified[64];
+	char mime_type[64];
+	HASH blob;
+};
+
+struct transfer {
+	struct image *image;
+	HASH key;
+	struct record rec;
+	/* rec is from cache. */
+	int cached;
+	CURL *curl;
+	struct curl_slist *headers;
+	char etag[sizeof ((struct record *)0)->etag];
+	char last_modified[sizeof ((struct record *)0)->last_modified];
+	FILE *body;
+	char *data;
+	size_t size;
+};
+
+static void
+hash_bytes(HASH hash, void const *data, size_t size)
+{
+	SHA1_CTX ctx;
+	BYTE bytes[SHA1_BLOCK_SIZE];
+	sha1_init(&ctx);
+	sha1_update(&ctx, data, size);
+	sha1_final(&ctx, bytes);
+	hash_from_sha1(hash, bytes);
+}
+
+static int
+read_line(char *s, int size, FILE *stream)
+{
+	if (!fgets(s, size, stream))
+		return 0;
+	s[strcspn(s, "\n")] = '\0';
+	return 1;
+}
+
+static int
+record_read(int dirfd, char const *key, struct record *rec)
+{
+	char name[32], checked[32];
+	snprintf(name, sizeof name, "url.%s", key);
+	int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	FILE *f = 0 <= fd ? fdopen(fd, "r") : NULL;
+	if (!f) {
+		if (0 <= fd)
+			close(fd);
+		return 0;
+	}
+
+	int ok = read_line(checked, sizeof checked, f) &&
+	         read_line(rec->etag, sizeof rec->etag, f) &&
+	         read_line(rec->last_modified, sizeof rec->last_modified, f) &&
+	         read_line(rec->mime_type, sizeof rec->mime_type, f) &&
+	         read_line(rec->blob, sizeof rec->blob, f);
+	fclose(f);
+	rec->checked = strtoll(checked, NULL, 10);
+
+	/* Image may have been removed. */
+	return ok && *rec->blob && !faccessat(dirfd, rec->blob, R_OK, 0);
+}
+
+/* Write data into name atomically. Other runs may write the same name. */
+static int
+file_write(int dirfd, char const *name, char const *data, size_t size)
+{
+	char tmpname[] = "tmp.XXXXXX";
+	int fd;
+	for (int tries = 0; tries < 100; ++tries) {
+		fill_tmpname(tmpname);
+		fd = openat(dirfd, tmpname,
+				O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (0 <= fd || EEXIST != errno)
+			break;
+	}
+	if (fd < 0) {
+		msg(LOG_WARNING, "Cannot write image cache: %s", strerror(errno));
+		return 0;
+	}
+
+	int ok = 1;
+	for (size_t n = 0; ok && n < size;) {
+		ssize_t rc = write(fd, data + n, size - n);
+		if (0 < rc)
+			n += rc;
+		else if (rc < 0 && EINTR != errno)
+			ok = 0;
+	}
+	ok &= !close(fd);
+	ok = ok && !renameat(dirfd, tmpname, dirfd, name);
+	if (!ok) {
+		msg(LOG_WARNING, "Cannot write image cache: %s", strerror(errno));
+		(void)unlinkat(dirfd, tmpname, 0);
+	}
+	return ok;
+}
+
+static void
+record_write(int dirfd, char const *key, struct record const *rec)
+{
+	char name[32], buf[512];
+	snprintf(name, sizeof name, "url.%s", key);
+	int n = snprintf(buf, sizeof buf, "%lld\n%s\n%s\n%s\n%s\n",
+			(long long)rec->checked, rec->etag, rec->last_modified,
+			rec->mime_type, rec->blob);
+	file_write(dirfd, name, buf, n);
+}
+
+static void
+image_set(struct image *image, struct record const *rec)
+{
+	strcpy(image->mime_type, rec->mime_type);
+	strcpy(image->blob, rec->blob);
+}
+
+static size_t
+write_cb(char *buf, size_t size, size_t nmemb, void *userdata)
+{
+	struct transfer *t = userdata;
+	size *= nmemb;
+	if (MAX_IMAGE_SIZE < ftell(t->body) + size)
+		return 0;
+	return fwrite(buf, 1, size, t->body);
+}
+
+static void
+header_copy(char *dest, size_t dest_size, char const *value, size_t n)
+{
+	while (n && (' ' == *value || '\t' == *value))
+		++value, --n;
+	while (n && ('\r' == value[n - 1] || '\n' == value[n - 1]))
+		--n;
+	snprintf(dest, dest_size, "%.*s", (int)n, value);
+}
+
+static size_t
+header_cb(char *buf, size_t size, size_t nmemb, void *userdata)
+{
+	struct transfer *t = userdata;
+	size *= nmemb;
+
+	/* Headers of a redirect do not count. */
+	if (!strncmp(buf, "HTTP/", 5)) {
+		*t->etag = '\0';
+		*t->last_modified = '\0';
+	} else if (!strncasecmp(buf, "ETag:", 5)) {
+		header_copy(t->etag, sizeof t->etag, buf + 5, size - 5);
+	} else if (!strncasecmp(buf, "Last-Modified:", 14)) {
+		header_copy(t->last_modified, sizeof t->last_modified, buf + 14, size - 14);
+	}
+	return size;
+}
+
+static int
+transfer_start(CURLM *multi, struct transfer *t, struct image_options const *opts)
+{
+	t->body = open_memstream(&t->data, &t->size);
+	t->curl = curl_easy_init();
+	if (!t->body || !t->curl)
+		return 0;
+
+	char buf[sizeof t->rec.etag + 32];
+	if (t->cached && *t->rec.etag) {
+		snprintf(buf, sizeof buf, "If-None-Match: %s", t->rec.etag);
+		t->headers = curl_slist_append(t->headers, buf);
+	} else if (t->cached && *t->rec.last_modified) {
+		snprintf(buf, sizeof buf, "If-Modified-Since: %s", t->rec.last_modified);
+		t->headers = curl_slist_append(t->headers, buf);
+	}
+
+	CURL *curl = t->curl;
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, t);
+	curl_easy_setopt(curl, CURLOPT_URL, t->image->url);
+	curl_easy_setopt(curl, CURLOPT_PROTOCOLS_STR, "http,https");
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L);
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
+	curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)MAX_IMAGE_SIZE);
+	curl_easy_setopt(curl, CURLOPT_PROXY, opts->proxy);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT,
+			*opts->user_agent ? opts->user_agent : NULL);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, t->headers);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, t);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, t);
+	return CURLM_OK == curl_multi_add_handle(multi, curl);
+}
+
+static void
+transfer_done(int dirfd, struct transfer *t, CURLcode rc, time_t now)
+{
+	struct record *rec = &t->rec;
+	long status = 0;
+	char *content_type = NULL;
+	if (CURLE_OK == rc) {
+		curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &status);
+		curl_easy_getinfo(t->curl, CURLINFO_CONTENT_TYPE, &content_type);
+	}
+	fclose(t->body);
+	t->body = NULL;
+
+	if (304 == status && t->cached) {
+		rec->checked = now;
+		record_write(dirfd, t->key, rec);
+		image_set(t->image, rec);
+		return;
+	}
+
+	if (200 == status && content_type &&
+	    !strncasecmp(content_type, "image/", 6) && t->size)
+	{
+		rec->checked = now;
+		strcpy(rec->etag, t->etag);
+		strcpy(rec->last_modified, t->last_modified);
+		snprintf(rec->mime_type, sizeof rec->mime_type, "%.*s",
+				(int)strcspn(content_type, "; \t"), content_type);
+		hash_bytes(rec->blob, t->data, t->size);
+		if ((!faccessat(dirfd, rec->blob, R_OK, 0) ||
+		     file_write(dirfd, rec->blob, t->data, t->size)))
+		{
+			record_write(dirfd, t->key, rec);
+			image_set(t->image, rec);
+		}
+		return;
+	}
+
+	if (CURLE_OK != rc)
+		msg(LOG_WARNING, "Cannot fetch image '%s': %s",
+				t->image->url, curl_easy_strerror(rc));
+	else if (200 != status)
+		msg(LOG_WARNING, "Cannot fetch image '%s': HTTP %ld",
+				t->image->url, status);
+	else
+		msg(LOG_WARNING, "Not an image: '%s'", t->image->url);
+
+	/* Better stale than nothing. */
+	if (t->cached)
+		image_set(t->image, rec);
+}
+
+void
+images_fetch(int dirfd, struct image *images, size_t nimages,
+		struct image_options const *opts)
+{
+	if (!nimages)
+		return;
+
+	time_t now = time(NULL);
+	struct transfer *transfers = calloc(nimages, sizeof *transfers);
+	CURLM *multi = curl_multi_init();
+	if (!transfers || !multi)
+		msg(LOG_ERR, "Cannot allocate memory");
+	curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)MAX_TRANSFERS);
+
+	size_t ntransfers = 0;
+	for (size_t i = 0; i < nimages; ++i) {
+		struct image *image = &images[i];
+		*image->mime_type = '\0';
+		*image->blob = '\0';
+
+		struct transfer *t = &transfers[ntransfers];
+		t->image = image;
+		hash_bytes(t->key, image->url, strlen(image->url));
+		t->cached = record_read(dirfd, t->key, &t->rec);
+		if (t->cached && now < t->rec.checked + opts->ttl) {
+			image_set(image, &t->rec);
+			continue;
+		}
+
+		++ntransfers;
+		if (!transfer_start(multi, t, opts)) {
+			msg(LOG_WARNING, "Cannot fetch image '%s'", image->url);
+			if (t->cached)
+				image_set(image, &t->rec);
+		}
+	}
+
+	for (int running = 1; running;) {
+		CURLMcode mc = curl_multi_perform(multi, &running);
+		if (CURLM_OK == mc && running)
+			mc = curl_multi_poll(multi, NULL, 0, 1000, NULL);
+		if (CURLM_OK != mc) {
+			msg(LOG_WARNING, "Cannot fetch images: %s", curl_multi_strerror(mc));
+			break;
+		}
+
+		CURLMsg *m;
+		for (int left; (m = curl_multi_info_read(multi, &left));) {
+			if (CURLMSG_DONE != m->msg)
+				continue;
+			struct transfer *t;
+			curl_easy_getinfo(m->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+			transfer_done(dirfd, t, m->data.result, now);
+		}
+	}
+
+	for (size_t i = 0; i < ntransfers; ++i) {
+		struct transfer *t = &transfers[i];
+		if (t->curl) {
+			curl_multi_remove_handle(multi, t->curl);
+			curl_easy_cleanup(t->curl);
+		}
+		curl_slist_free_all(t->headers);
+		if (t->body)
+			fclose(t->body);
+		free(t->data);
+	}
+	curl_multi_cleanup(multi);
+	free(transfers);
+}
+
+/* Write image as a MIME part. */
+int
+images_write_part(FILE *stream, int dirfd, struct image const *image)
+{
+	static char const BASE64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	int fd = openat(dirfd, image->blob, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) || !st.st_size) {
+		if (0 <= fd)
+			close(fd);
+		return 0;
+	}
+	unsigned char const *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == data)
+		return 0;
+
+	fprintf(stream,
+			"Content-Type: %s\n"
+			"Content-Transfer-Encoding: base64\n"
+			"Content-ID: <%s@mrss>\n"
+			"Content-Disposition: inline\n"
+			"\n",
+			image->mime_type, image->blob);
+
+	/* 76 characters per line. */
+	size_t size = st.st_size;
+	for (size_t i = 0; i < size; i += 3) {
+		unsigned long v = (unsigned long)data[i] << 16;
+		if (i + 1 < size)
+			v |= data[i + 1] << 8;
+		if (i + 2 < size)
+			v |= data[i + 2];
+
+		char out[4] = {
+			BASE64[v >> 18 & 0x3f],
+			BASE64[v >> 12 & 0x3f],
+			i + 1 < size ? BASE64[v >> 6 & 0x3f] : '=',
+			i + 2 < size ? BASE64[v & 0x3f] : '=',
+		};
+		fwrite(out, 1, sizeof out, stream);
+		if (!((i + 3) % 57) || size <= i + 3)
+			fputc('\n', stream);
+	}
+
+	munmap((void *)data, st.st_size);
+	return 1;
+}
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libxml/parser.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "mrss.h"
+
+/* @see https://pubs.opengroup.org/onlinepubs/9699919799/utilities/pax.html */
+
+#define TAR_BLOCK 512
+
+/* Snapshots are parsed this many per thread at a time. */
+#define JOBS_PER_THREAD 4
+#define MAX_THREADS 64
+
+struct job {
+	char *name;
+	/* Tar member. NULL if file of directory. */
+	char *data;
+	size_t size;
+	int err;
+	xmlDocPtr doc;
+};
+
+static struct window {
+	int dirfd;
+	struct job jobs[JOBS_PER_THREAD * MAX_THREADS];
+	size_t njobs;
+	size_t next;
+} window = { .dirfd = -1 };
+
+static void
+job_parse(struct job *job)
+{
+	if (job->data) {
+		job->doc = xmlReadMemory(job->data, job->size, NULL, NULL, 0);
+		return;
+	}
+
+	int fd = openat(window.dirfd, job->name, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		job->err = errno;
+	} else if (0 < st.st_size) {
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED == data) {
+			job->err = errno;
+		} else {
+			job->doc = xmlReadMemory(data, st.st_size, NULL, NULL, 0);
+			munmap(data, st.st_size);
+		}
+	}
+	if (0 <= fd)
+		close(fd);
+}
+
+static void *
+worker(void *arg)
+{
+	(void)arg;
+	for (size_t i;
+	     (i = __atomic_fetch_add(&window.next, 1, __ATOMIC_RELAXED)) < window.njobs;)
+		job_parse(&window.jobs[i]);
+	return NULL;
+}
+
+static void
+window_parse(size_t nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+
+	window.next = 0;
+	if (window.njobs < nthreads)
+		nthreads = window.njobs;
+
+	/* Calling thread is a worker too. */
+	size_t n = 1;
+	for (; n < nthreads; ++n)
+		if (pthread_create(&threads[n], NULL, worker, NULL))
+			break;
+	worker(NULL);
+	while (1 < n)
+		pthread_join(threads[--n], NULL);
+}
+
+static void
+window_release(void *p)
+{
+	struct window *w = p;
+	for (size_t i = 0; i < w->njobs; ++i) {
+		struct job *job = &w->jobs[i];
+		xmlFreeDoc(job->doc);
+		free(job->data);
+		free(job->name);
+	}
+	w->njobs = 0;
+}
+
+struct dir {
+	struct dirent **names;
+	int i, n;
+};
+
+static void
+dir_release(void *p)
+{
+	struct dir *dir = p;
+	while (dir->i < dir->n)
+		free(dir->names[dir->i++]);
+	free(dir->names);
+
+	if (0 <= window.dirfd)
+		close(window.dirfd);
+	window.dirfd = -1;
+}
+
+static void
+stream_release(void *p)
+{
+	fclose(p);
+}
+
+/* Hand over parsed documents in order, then let the caller flush them. */
+static void
+window_process(size_t nthreads, struct import_handler const *handler)
+{
+	window_parse(nthreads);
+
+	for (size_t i = 0; i < window.njobs; ++i) {
+		struct job *job = &window.jobs[i];
+		if (job->err)
+			msg(LOG_WARNING, "Cannot read '%s': %s",
+					job->name, strerror(job->err));
+		else if (!job->doc)
+			msg(LOG_WARNING, "Invalid XML: '%s'", job->name);
+		else
+			handler->process(job->name, job->doc);
+	}
+	window_release(&window);
+	handler->flush();
+}
+
+static int
+is_xml_name(char const *name)
+{
+	size_t n = strlen(name);
+	return 4 < n && !strcmp(name + n - 4, ".xml") && '.' != *name;
+}
+
+static int
+dirent_filter(struct dirent const *d)
+{
+	return (DT_REG == d->d_type || DT_LNK == d->d_type ||
+	        DT_UNKNOWN == d->d_type) &&
+	       is_xml_name(d->d_name);
+}
+
+static void
+import_dir(char const *path, size_t nthreads,
+		struct import_handler const *handler)
+{
+	struct dir dir = { 0 };
+	dir.n = scandir(path, &dir.names, dirent_filter, alphasort);
+	if (dir.n < 0)
+		msg(LOG_ERR, "Cannot open '%s': %s", path, strerror(errno));
+	feed_track(dir_release, &dir);
+
+	window.dirfd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (window.dirfd < 0)
+		msg(LOG_ERR, "Cannot open '%s': %s", path, strerror(errno));
+
+	size_t window_size = nthreads * JOBS_PER_THREAD;
+	while (dir.i < dir.n) {
+		while (dir.i < dir.n && window.njobs < window_size) {
+			struct job *job = &window.jobs[window.njobs++];
+			*job = (struct job){ .name = strdup(dir.names[dir.i]->d_name) };
+			free(dir.names[dir.i++]);
+			if (!job->name)
+				job->err = ENOMEM;
+		}
+		window_process(nthreads, handler);
+	}
+
+	feed_untrack(&dir);
+	dir_release(&dir);
+}
+
+static size_t
+tar_number(char const *s, size_t n)
+{
+	size_t ret = 0;
+	for (; n && ' ' == *s; --n, ++s);
+	for (; n && '0' <= *s && *s <= '7'; --n, ++s)
+		ret = ret * 8 + (*s - '0');
+	return ret;
+}
+
+static void
+tar_read(FILE *stream, void *buf, size_t size)
+{
+	if (size != fread(buf, 1, size, stream))
+		msg(LOG_ERR, "Truncated tar archive");
+}
+
+/* Read member data padded to whole blocks. */
+static char *
+tar_read_data(FILE *stream, size_t size)
+{
+	char *data = malloc(size + 1);
+	if (!data)
+		msg(LOG_ERR, "Cannot allocate memory");
+	if (size != fread(data, 1, size, stream)) {
+		free(data);
+		msg(LOG_ERR, "Truncated tar archive");
+	}
+	data[size] = '\0';
+
+	char pad[TAR_BLOCK];
+	if (size % TAR_BLOCK)
+		tar_read(stream, pad, TAR_BLOCK - size % TAR_BLOCK);
+	return data;
+}
+
+/* Skip member data without keeping it. Pipes are read through. */
+static void
+tar_skip_data(FILE *stream, size_t size)
+{
+	size = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+	if (!fseeko(stream, size, SEEK_CUR))
+		return;
+
+	char buf[16 * TAR_BLOCK];
+	while (size) {
+		size_t n = size < sizeof buf ? size : sizeof buf;
+		tar_read(stream, buf, n);
+		size -= n;
+	}
+}
+
+static void
+import_tar(FILE *stream, size_t nthreads,
+		struct import_handler const *handler)
+{
+	char long_name[PATH_MAX] = "";
+	size_t window_size = nthreads * JOBS_PER_THREAD;
+
+	for (;;) {
+		unsigned char header[TAR_BLOCK];
+		if (!fread(header, TAR_BLOCK, 1, stream))
+			break;
+
+		/* End of archive. */
+		if (!header[0])
+			break;
+
+		char const *h = (char const *)header;
+		size_t size = tar_number(h + 124, 12);
+		char type = h[156];
+
+		char name[PATH_MAX];
+		if (*long_name) {
+			strcpy(name, long_name);
+			*long_name = '\0';
+		} else if (!memcmp(h + 257, "ustar", 5) && h[345]) {
+			snprintf(name, sizeof name, "%.155s/%.100s", h + 345, h);
+		} else {
+			snprintf(name, sizeof name, "%.100s", h);
+		}
+
+		/* GNU long name of the next member. */
+		if ('L' == type) {
+			char *data = tar_read_data(stream, size);
+			snprintf(long_name, sizeof long_name, "%s", data);
+			free(data);
+			continue;
+		}
+
+		/* Records of pax extended header are "LENGTH KEY=VALUE\n". */
+		if ('x' == type) {
+			char *data = tar_read_data(stream, size);
+			char const *s = strstr(data, " path=");
+			if (s) {
+				s += 6;
+				snprintf(long_name, sizeof long_name, "%.*s",
+						(int)strcspn(s, "\n"), s);
+			}
+			free(data);
+			continue;
+		}
+
+		char const *base = strrchr(name, '/');
+		base = base ? base + 1 : name;
+		if (('0' != type && '\0' != type) || !is_xml_name(base)) {
+			tar_skip_data(stream, size);
+			continue;
+		}
+
+		char *data = tar_read_data(stream, size);
+		struct job *job = &window.jobs[window.njobs++];
+		*job = (struct job){
+			.name = strdup(name),
+			.data = data,
+			.size = size,
+		};
+		if (!job->name)
+			job->err = ENOMEM;
+
+		if (window_size <= window.njobs)
+			window_process(nthreads, handler);
+	}
+	if (ferror(stream))
+		msg(LOG_ERR, "Cannot read tar archive: %s", strerror(errno));
+
+	window_process(nthreads, handler);
+}
+
+void
+import_feeds(char const *path, struct import_handler const *handler)
+{
+	long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads = nprocs < 1 ? 1 : MAX_THREADS < nprocs ? MAX_THREADS : nprocs;
+
+	/* Before threads start parsing. */
+	xmlInitParser();
+
+	feed_track(window_release, &window);
+
+	struct stat st;
+	if (!strcmp(path, "-")) {
+		import_tar(stdin, nthreads, handler);
+	} else if (stat(path, &st)) {
+		msg(LOG_ERR, "Cannot open '%s': %s", path, strerror(errno));
+	} else if (S_ISDIR(st.st_mode)) {
+		import_dir(path, nthreads, handler);
+	} else {
+		FILE *stream = fopen(path, "re");
+		if (!stream)
+			msg(LOG_ERR, "Cannot open '%s': %s", path, strerror(errno));
+		feed_track(stream_release, stream);
+		import_tar(stream, nthreads, handler);
+		feed_untrack(stream);
+		fclose(stream);
+	}
+
+	feed_untrack(&window);
+}
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "mrss.h"
+
+/* @see https://www.rfc-editor.org/rfc/rfc2033 (LMTP) */
+/* @see https://www.rfc-editor.org/rfc/rfc2920 (PIPELINING) */
+/* @see https://www.rfc-editor.org/rfc/rfc3030 (CHUNKING) */
+
+struct lmtp {
+	int fd;
+	FILE *rx;
+	/* Commands to be sent together. */
+	FILE *tx;
+	char *tx_buf;
+	size_t tx_size;
+	char *line;
+	size_t line_size;
+	/* First failure reply since last check. */
+	char failure[512];
+	int pipelining;
+	int chunking;
+};
+
+static void
+lmtp_close(struct lmtp *lmtp)
+{
+	if (lmtp->tx)
+		fclose(lmtp->tx);
+	free(lmtp->tx_buf);
+	free(lmtp->line);
+	if (lmtp->rx)
+		fclose(lmtp->rx);
+	else if (0 <= lmtp->fd)
+		close(lmtp->fd);
+}
+
+static void
+lmtp_fail(struct lmtp *lmtp, char const *what, int err)
+{
+	char buf[512];
+	snprintf(buf, sizeof buf, "%s: %s",
+			what, err ? strerror(err) : "Unexpected reply");
+	lmtp_close(lmtp);
+	msg(LOG_ERR, "LMTP error: %s", buf);
+}
+
+static void
+lmtp_connect(struct lmtp *lmtp, char const *path)
+{
+	*lmtp = (struct lmtp){ .fd = -1 };
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (sizeof addr.sun_path <= strlen(path))
+		msg(LOG_ERR, "Too long socket path: '%s'", path);
+	strcpy(addr.sun_path, path);
+
+	lmtp->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lmtp->fd < 0)
+		lmtp_fail(lmtp, "Cannot create socket", errno);
+	if (connect(lmtp->fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+		lmtp_fail(lmtp, path, errno);
+
+	lmtp->rx = fdopen(lmtp->fd, "r");
+	lmtp->tx = open_memstream(&lmtp->tx_buf, &lmtp->tx_size);
+	if (!lmtp->rx || !lmtp->tx)
+		lmtp_fail(lmtp, "Cannot allocate memory", errno);
+}
+
+/* Send everything queued so far in a single write. */
+static void
+lmtp_send(struct lmtp *lmtp)
+{
+	if (fflush(lmtp->tx))
+		lmtp_fail(lmtp, "Cannot allocate memory", errno);
+
+	for (size_t off = 0; off < lmtp->tx_size;) {
+		ssize_t n = send(lmtp->fd, lmtp->tx_buf + off, lmtp->tx_size - off,
+				MSG_NOSIGNAL);
+		if (n < 0) {
+			if (EINTR == errno)
+				continue;
+			lmtp_fail(lmtp, "Cannot send", errno);
+		}
+		off += n;
+	}
+
+	rewind(lmtp->tx);
+}
+
+static int
+lmtp_read_reply(struct lmtp *lmtp)
+{
+	int code;
+	int more;
+	do {
+		errno = 0;
+		ssize_t n = getline(&lmtp->line, &lmtp->line_size, lmtp->rx);
+		if (n <= 0)
+			lmtp_fail(lmtp, "Connection closed", errno);
+		while (0 < n && ('\r' == lmtp->line[n - 1] || '\n' == lmtp->line[n - 1]))
+			lmtp->line[--n] = '\0';
+
+		code = atoi(lmtp->line);
+		if (n < 3 || code < 200 || 600 <= code)
+			lmtp_fail(lmtp, lmtp->line, 0);
+
+		more = 3 < n && '-' == lmtp->line[3];
+		char const *keyword = 4 <= n ? lmtp->line + 4 : "";
+		if (!strcasecmp(keyword, "PIPELINING"))
+			lmtp->pipelining = 1;
+		else if (!strcasecmp(keyword, "CHUNKING"))
+			lmtp->chunking = 1;
+	} while (more);
+
+	msg(LOG_DEBUG, "LMTP: %s", lmtp->line);
+	/* Later replies of a pipelined sequence may hide it. */
+	if (400 <= code && !*lmtp->failure)
+		snprintf(lmtp->failure, sizeof lmtp->failure, "%s", lmtp->line);
+	return code;
+}
+
+/* First failure of a pipelined command sequence. */
+static int
+lmtp_worst(int code, int next)
+{
+	return 300 <= code ? code : next;
+}
+
+/* Returns whether delivery should be retried. */
+static int
+lmtp_check(struct lmtp *lmtp, struct outbox_mail const *m, int code)
+{
+	char const *reply = *lmtp->failure ? lmtp->failure : lmtp->line;
+	int ret = 0;
+	if (300 <= code) {
+		msg(LOG_WARNING, "LMTP: Mail %s %s: %s",
+				m->name,
+				code < 500 ? "temporarily failed" : "rejected",
+				reply);
+		ret = code < 500;
+	}
+	*lmtp->failure = '\0';
+	return ret;
+}
+
+static void
+lmtp_put_envelope(struct lmtp *lmtp, char const *recipient)
+{
+	fprintf(lmtp->tx,
+			"MAIL FROM:<>\r\n"
+			"RCPT TO:<%s>\r\n",
+			recipient);
+}
+
+/* Write mail in canonical (CRLF) form. */
+static void
+lmtp_put_data(struct lmtp *lmtp, struct outbox_mail const *m, int dot_stuff)
+{
+	int bol = 1;
+	for (size_t i = 0; i < m->size; ++i) {
+		char c = m->data[i];
+		if (bol && dot_stuff && '.' == c)
+			fputc('.', lmtp->tx);
+		if ('\n' == c && !(0 < i && '\r' == m->data[i - 1]))
+			fputc('\r', lmtp->tx);
+		fputc(c, lmtp->tx);
+		bol = '\n' == c;
+	}
+	if (!bol)
+		fputs("\r\n", lmtp->tx);
+}
+
+static size_t
+lmtp_data_size(struct outbox_mail const *m)
+{
+	size_t size = m->size;
+	for (size_t i = 0; i < m->size; ++i)
+		if ('\n' == m->data[i] && !(0 < i && '\r' == m->data[i - 1]))
+			++size;
+	if (m->size && '\n' != m->data[m->size - 1])
+		size += 2;
+	return size;
+}
+
+/* Move mail to be retried behind the previous ones. */
+static void
+lmtp_retry(struct outbox_mail *mails, size_t *nretry, size_t i)
+{
+	struct outbox_mail t = mails[*nretry];
+	mails[(*nretry)++] = mails[i];
+	mails[i] = t;
+}
+
+/* Whole batch in a single round-trip. */
+static size_t
+lmtp_deliver_chunked(struct lmtp *lmtp, char const *recipient,
+		struct outbox_mail *mails, size_t nmails)
+{
+	for (size_t i = 0; i < nmails; ++i) {
+		lmtp_put_envelope(lmtp, recipient);
+		fprintf(lmtp->tx, "BDAT %zu LAST\r\n", lmtp_data_size(&mails[i]));
+		lmtp_put_data(lmtp, &mails[i], 0);
+	}
+	lmtp_send(lmtp);
+
+	size_t nretry = 0;
+	for (size_t i = 0; i < nmails; ++i) {
+		int code = lmtp_read_reply(lmtp);
+		code = lmtp_worst(code, lmtp_read_reply(lmtp));
+		code = lmtp_worst(code, lmtp_read_reply(lmtp));
+		if (lmtp_check(lmtp, &mails[i], code))
+			lmtp_retry(mails, &nretry, i);
+	}
+	return nretry;
+}
+
+/*
+ * DATA must end a command group so wait for 354 each time but send mail
+ * content together with envelope of the next mail.
+ */
+static size_t
+lmtp_deliver_data(struct lmtp *lmtp, char const *recipient,
+		struct outbox_mail *mails, size_t nmails)
+{
+	size_t nretry = 0;
+	/* Mail waiting for its end-of-data reply. */
+	size_t pending = nmails;
+
+	for (size_t i = 0; i < nmails; ++i) {
+		lmtp_put_envelope(lmtp, recipient);
+		fputs("DATA\r\n", lmtp->tx);
+		lmtp_send(lmtp);
+
+		if (pending < nmails &&
+		    lmtp_check(lmtp, &mails[pending], lmtp_read_reply(lmtp)))
+			lmtp_retry(mails, &nretry, pending);
+		pending = nmails;
+
+		int code = lmtp_read_reply(lmtp);
+		code = lmtp_worst(code, lmtp_read_reply(lmtp));
+		int data_code = lmtp_read_reply(lmtp);
+		if (code < 300 && 354 == data_code) {
+			lmtp_put_data(lmtp, &mails[i], 1);
+			fputs(".\r\n", lmtp->tx);
+			pending = i;
+		} else if (lmtp_check(lmtp, &mails[i], lmtp_worst(code, data_code))) {
+			lmtp_retry(mails, &nretry, i);
+		}
+	}
+
+	if (pending < nmails) {
+		lmtp_send(lmtp);
+		if (lmtp_check(lmtp, &mails[pending], lmtp_read_reply(lmtp)))
+			lmtp_retry(mails, &nretry, pending);
+	}
+
+	return nretry;
+}
+
+size_t
+lmtp_deliver(char const *path, char const *recipient,
+		struct outbox_mail *mails, size_t nmails)
+{
+	if (!recipient)
+		msg(LOG_ERR, "LMTP recipient is not set");
+
+	struct lmtp lmtp;
+	lmtp_connect(&lmtp, path);
+
+	if (220 != lmtp_read_reply(&lmtp))
+		lmtp_fail(&lmtp, "Service not available", 0);
+
+	char hostname[256];
+	if (gethostname(hostname, sizeof hostname))
+		strcpy(hostname, "localhost");
+	fprintf(lmtp.tx, "LHLO %s\r\n", hostname);
+	lmtp_send(&lmtp);
+	if (250 != lmtp_read_reply(&lmtp))
+		lmtp_fail(&lmtp, "LHLO refused", 0);
+	if (!lmtp.pipelining)
+		lmtp_fail(&lmtp, "Server does not support PIPELINING", 0);
+
+	size_t nretry = lmtp.chunking
+		? lmtp_deliver_chunked(&lmtp, recipient, mails, nmails)
+		: lmtp_deliver_data(&lmtp, recipient, mails, nmails);
+
+	fputs("QUIT\r\n", lmtp.tx);
+	lmtp_send(&lmtp);
+	if (221 != lmtp_read_reply(&lmtp))
+		msg(LOG_WARNING, "LMTP: Unexpected reply to QUIT: %s", lmtp.line);
+	lmtp_close(&lmtp);
+
+	return nretry;
+}
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "mrss.h"
+
+/* @see https://prometheus.io/docs/instrumenting/exposition_formats/ */
+
+#define ARRAY_SIZE(a) (sizeof a / sizeof *a)
+
+static char const *const RESULT_LABELS[] = {
+	[FEED_FETCHED] = "fetched",
+	[FEED_NOT_MODIFIED] = "not_modified",
+	[FEED_CACHED] = "cached",
+	[FEED_ERRORED] = "errored",
+};
+
+enum error_class {
+	ERROR_NETWORK,
+	ERROR_HTTP,
+	ERROR_PARSE,
+	ERROR_DELIVERY,
+	ERROR_STATE,
+	ERROR_NCLASSES,
+};
+
+static char const *const ERROR_LABELS[] = {
+	[ERROR_NETWORK] = "network",
+	[ERROR_HTTP] = "http",
+	[ERROR_PARSE] = "parse",
+	[ERROR_DELIVERY] = "delivery",
+	[ERROR_STATE] = "state",
+};
+
+static double const FEED_BUCKETS[] = {
+	.01, .025, .05, .1, .25, .5, 1, 2.5, 5, 10, 30, 60,
+};
+
+static double const RUN_BUCKETS[] = {
+	1, 5, 10, 30, 60, 120, 300, 600, 1800, 3600,
+};
+
+static struct {
+	unsigned long long feeds[ARRAY_SIZE(RESULT_LABELS)];
+	unsigned long long errors[ERROR_NCLASSES];
+	unsigned long long bytes;
+	unsigned long long bytes_saved;
+	unsigned long long entries;
+	unsigned long long mails;
+	unsigned long long mails_linked;
+	unsigned long long mails_pruned;
+	unsigned long long mails_replaced;
+	unsigned long long root_mails_skipped;
+	unsigned long long feed_buckets[ARRAY_SIZE(FEED_BUCKETS)];
+	unsigned long long feed_count;
+	double feed_sum;
+} m;
+
+struct family {
+	char const *name;
+	char const *type;
+	char const *help;
+};
+
+static struct family const
+	FEEDS = { "mrss_feeds_total", "counter", "Processed feeds by result." },
+	ERRORS = { "mrss_feed_errors_total", "counter", "Errored feeds by class." },
+	BYTES = { "mrss_downloaded_bytes_total", "counter", "Bytes downloaded." },
+	BYTES_SAVED = { "mrss_not_modified_bytes_total", "counter", "Bytes not downloaded thanks to conditional requests." },
+	ENTRIES = { "mrss_entries_written_total", "counter", "New entries turned into mails." },
+	MAILS = { "mrss_mails_delivered_total", "counter", "Delivered mails, including root mails." },
+	MAILS_LINKED = { "mrss_mails_linked_total", "counter", "Mails hardlinked from the deduplication store." },
+	MAILS_PRUNED = { "mrss_mails_pruned_total", "counter", "Mails removed past retention limit." },
+	MAILS_REPLACED = { "mrss_mails_replaced_total", "counter", "Mails that overwrote the previous version of their entry." },
+	ROOT_MAILS = { "mrss_root_mails_skipped_total", "counter", "Regenerated root mails dropped before delivery." },
+	FEED_DURATION = { "mrss_feed_duration_seconds", "histogram", "Time spent processing a feed." },
+	RUN_DURATION = { "mrss_run_duration_seconds", "histogram", "Duration of runs." },
+	LAST_RUN = { "mrss_last_run_timestamp_seconds", "gauge", "Time when the last run finished." };
+
+struct series {
+	struct family const *family;
+	char key[128];
+	double value;
+};
+
+static struct series *series;
+static size_t nseries, nseries_alloc;
+
+static void
+add(struct family const *family, char const *suffix, char const *labels,
+		double value)
+{
+	if (nseries_alloc <= nseries) {
+		size_t n = nseries_alloc ? 2 * nseries_alloc : 64;
+		struct series *p = realloc(series, n * sizeof *p);
+		if (!p)
+			msg(LOG_ERR, "Cannot allocate memory");
+		series = p;
+		nseries_alloc = n;
+	}
+
+	struct series *s = &series[nseries++];
+	s->family = family;
+	snprintf(s->key, sizeof s->key, "%s%s%s%s%s",
+			family->name, suffix,
+			*labels ? "{" : "", labels, *labels ? "}" : "");
+	s->value = value;
+}
+
+static void
+add_histogram(struct family const *family,
+		double const *bounds, size_t nbounds,
+		unsigned long long const *buckets,
+		unsigned long long count, double sum)
+{
+	for (size_t i = 0; i < nbounds; ++i) {
+		char labels[32];
+		snprintf(labels, sizeof labels, "le=\"%g\"", bounds[i]);
+		add(family, "_bucket", labels, buckets[i]);
+	}
+	add(family, "_bucket", "le=\"+Inf\"", count);
+	add(family, "_sum", "", sum);
+	add(family, "_count", "", count);
+}
+
+static enum error_class
+classify_error(struct feed_stats const *s)
+{
+	switch (s->phase) {
+	case FEED_PHASE_FETCH:
+		return 400 <= s->status ? ERROR_HTTP : ERROR_NETWORK;
+	case FEED_PHASE_PARSE:
+		return ERROR_PARSE;
+	case FEED_PHASE_DELIVER:
+		return ERROR_DELIVERY;
+	case FEED_PHASE_STATE:
+	default:
+		return ERROR_STATE;
+	}
+}
+
+void
+metrics_feed(struct feed_stats const *s)
+{
+	++m.feeds[s->result];
+	if (FEED_ERRORED == s->result)
+		++m.errors[classify_error(s)];
+	m.bytes += s->bytes;
+	m.bytes_saved += s->bytes_saved;
+	m.entries += s->entries_new;
+	m.mails += s->mails;
+	m.mails_linked += s->mails_linked;
+	m.mails_pruned += s->mails_pruned;
+	m.mails_replaced += s->mails_replaced;
+	m.root_mails_skipped += s->root_mails_skipped;
+
+	double seconds = s->total / 1e6;
+	for (size_t i = 0; i < ARRAY_SIZE(FEED_BUCKETS); ++i)
+		m.feed_buckets[i] += seconds <= FEED_BUCKETS[i];
+	++m.feed_count;
+	m.feed_sum += seconds;
+}
+
+/* Counters of previous runs continue. */
+static void
+merge(FILE *old)
+{
+	char line[512];
+	while (fgets(line, sizeof line, old)) {
+		if ('#' == *line)
+			continue;
+
+		char *value = strrchr(line, ' ');
+		if (!value)
+			continue;
+		*value++ = '\0';
+
+		for (size_t i = 0; i < nseries; ++i)
+			if (&LAST_RUN != series[i].family &&
+			    !strcmp(series[i].key, line))
+			{
+				series[i].value += strtod(value, NULL);
+				break;
+			}
+	}
+}
+
+void
+metrics_write(FILE *stream, FILE *old, double run_duration)
+{
+	nseries = 0;
+
+	for (size_t i = 0; i < ARRAY_SIZE(RESULT_LABELS); ++i) {
+		char labels[32];
+		snprintf(labels, sizeof labels, "result=\"%s\"", RESULT_LABELS[i]);
+		add(&FEEDS, "", labels, m.feeds[i]);
+	}
+	for (size_t i = 0; i < ERROR_NCLASSES; ++i) {
+		char labels[32];
+		snprintf(labels, sizeof labels, "class=\"%s\"", ERROR_LABELS[i]);
+		add(&ERRORS, "", labels, m.errors[i]);
+	}
+	add(&BYTES, "", "", m.bytes);
+	add(&BYTES_SAVED, "", "", m.bytes_saved);
+	add(&ENTRIES, "", "", m.entries);
+	add(&MAILS, "", "", m.mails);
+	add(&MAILS_LINKED, "", "", m.mails_linked);
+	add(&MAILS_PRUNED, "", "", m.mails_pruned);
+	add(&MAILS_REPLACED, "", "", m.mails_replaced);
+	add(&ROOT_MAILS, "", "", m.root_mails_skipped);
+	add_histogram(&FEED_DURATION,
+			FEED_BUCKETS, ARRAY_SIZE(FEED_BUCKETS),
+			m.feed_buckets, m.feed_count, m.feed_sum);
+
+	unsigned long long run_buckets[ARRAY_SIZE(RUN_BUCKETS)];
+	for (size_t i = 0; i < ARRAY_SIZE(RUN_BUCKETS); ++i)
+		run_buckets[i] = run_duration <= RUN_BUCKETS[i];
+	add_histogram(&RUN_DURATION,
+			RUN_BUCKETS, ARRAY_SIZE(RUN_BUCKETS),
+			run_buckets, 1, run_duration);
+
+	add(&LAST_RUN, "", "", time(NULL));
+
+	if (old)
+		merge(old);
+
+	struct family const *family = NULL;
+	for (size_t i = 0; i < nseries; ++i) {
+		struct series const *s = &series[i];
+		if (family != s->family) {
+			family = s->family;
+			fprintf(stream, "# HELP %s %s\n# TYPE %s %s\n",
+					family->name, family->help,
+					family->name, family->type);
+		}
+		fprintf(stream, "%s %.15g\n", s->key, s->value);
+	}
+
+	free(series);
+	series = NULL;
+	nseries = nseries_alloc = 0;
+}
@@ -2,29 +2,60 @@
 
 #include <ctype.h>
 #include <curl/curl.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <libxml/tree.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
 
 #include "sha1.h"
+#include "trace.h"
 #include "version.h"
 #include "mrss.h"
+#ifdef HAVE_IO_URING
+# include "uring.h"
+#endif
 
-static char const MAIL_TMPNAME[] = "tmp/mrss-XXXXXX";
+static char const MAIL_TMPNAME[] = "mrss-XXXXXX";
+static char const DEDUP_DIR[] = ".mrssdedup";
+static char const IMAGES_DIR[] = ".mrssimages";
+
+/* Images inlined into a mail at most. Others are left remote. */
+#define MAX_MAIL_IMAGES 64
+
+enum durability {
+	DURABILITY_NONE,
+	DURABILITY_BATCH,
+	DURABILITY_STRICT,
+};
 
 struct mail {
 	FILE *stream;
-	char path[sizeof MAIL_TMPNAME];
+	char *data;
+	size_t size;
+	/* Body to be completed by outbox_render(). */
+	char *html;
+	/* Set by filter. */
+	char const *folder;
+};
+
+struct tmpfile {
+	int dirfd;
+	char name[32];
+	FILE *stream;
 };
 
 enum rfc822_type {
@@ -33,57 +64,189 @@ enum rfc822_type {
 	RFC822_NONASCII,
 };
 
-typedef char HASH[16 + 1 /* NUL */];
-
 static char const RFC_822[] = "%a, %d %b %Y %T %z";
 /* Shall be always GMT. Use with gmtime(). */
 static char const RFC_2616[] = "%a, %d %b %Y %T %Z";
 
+static char opt_folder[128];
 static char opt_from[128];
+static char opt_hub_callback[1024];
+static char opt_hub_secret[200];
+static char opt_lmtp[PATH_MAX];
+static char opt_lmtp_recipient[128];
 static char opt_proxy[1024];
 static char opt_user_agent[128];
+static enum durability opt_durability = DURABILITY_NONE;
+static int opt_dedup = 0;
+static int opt_digest = 0;
+static int opt_dry_run = 0;
+static int opt_command_cpu = 0;
+static int opt_command_memory = 0;
+static int opt_command_timeout = 0;
 static int opt_expiration = 0;
+static int opt_image_ttl = 24 * 60 * 60;
+static int opt_inline_images = 0;
+static int opt_io_uring = 1;
+static int opt_jobs = 1;
+static int opt_max_entries = 0;
+static int opt_max_entry_size = 0;
+static int opt_max_response_size = 0;
+static int opt_prune_age = 0;
+static int opt_prune_count = 0;
+static int opt_replace = 1;
 static int opt_reply_to = 1;
 static int opt_verbose = 0;
 
 static long local_timezone;
 
+/* Cassette directories. */
+static int record_dirfd = -1;
+static int replay_dirfd = -1;
+
+/* Response being recorded. */
+static struct {
+	HASH name;
+	FILE *body;
+	char body_tmpname[sizeof "body.XXXXXX"];
+	SHA1_CTX body_sha1;
+	FILE *headers;
+	char *headers_buf;
+	size_t headers_size;
+} rec;
+
+/* Statistics of the feed being processed. */
+static struct feed_stats stats;
+
+static int metrics_dirfd = -1;
+static char metrics_name[NAME_MAX + 1];
+static long long run_start;
+
+static FILE *report;
+static long long report_start;
+static struct feed_stats *report_stats;
+static size_t report_nstats;
+static size_t report_alloc;
+
 static CURL *curl;
+/* Set by write_xml(). */
+static int xml_invalid;
 static char curl_error_buf[CURL_ERROR_SIZE];
 struct {
 	time_t last_modified;
 	time_t expiration;
 	char etag[1024];
+	/* Body size of the last full response. */
+	long long size;
+	/* End of WebSub subscription. */
+	time_t lease;
 } old_state, new_state;
+/* Date of the oldest entry dropped by max_entries. Zero if none. */
+static time_t dropped_since;
+
+/* Content received from a WebSub hub. */
+static struct {
+	char const *data;
+	size_t size;
+} push;
+
+/* Settings of a url command for processing the feed later. */
+struct feed_context {
+	char dir[PATH_MAX];
+	char folder[sizeof opt_folder];
+	char from[sizeof opt_from];
+	int digest;
+	int prune_age;
+	int prune_count;
+};
+
+/* Feeds that serve accepts callbacks for. */
+static struct websub_feed {
+	HASH id;
+	char *url;
+	/* Topic of the subscription requested in this run. */
+	xmlChar *topic;
+	struct feed_context ctx;
+} *websub_feeds;
+static size_t websub_nfeeds;
+static size_t websub_alloc;
+
+/* system: feed whose command is run by spawn_run(). */
+struct program {
+	char *url;
+	struct feed_context ctx;
+	int expiration;
+	/* Where output is parsed into. */
+	xmlParserCtxtPtr *xml;
+	/* Own parser if run in parallel. */
+	xmlParserCtxtPtr ctxt;
+	long long bytes;
+	long long parse;
+	int invalid;
+	int oversized;
+	int status;
+	/* Environment with the state of the feed. */
+	char **env;
+	char *env_vars;
+	/* Validators reported on the side channel, as header lines. */
+	char headers[2048];
+	size_t nheaders;
+};
+
+/* Feeds waiting for their commands to run in parallel. */
+static struct program *programs;
+static size_t nprograms;
+static size_t programs_alloc;
+/* Whose output is being processed. */
+static struct program *program_finished;
 
 static jmp_buf errctx;
 static int have_errctx;
 
-void
-entry_uninit(struct entry *e)
-{
-	for (struct entry_author *author = e->authors;
-	      ARRAY_IN(e->authors, author);
-	      ++author)
-	{
-		xmlFree(author->name);
-		xmlFree(author->email);
-	}
-
-	for (struct entry_category *category = e->categories;
-	      ARRAY_IN(e->categories, category);
-	      ++category)
-		xmlFree(category->name);
+/* Recently used Maildir folders. */
+static struct maildir {
+	int used;
+	char folder[sizeof opt_folder];
+	int tmp;
+	int new;
+	int cur;
+} maildirs[64];
+static size_t maildirs_next;
+
+/* Content-addressed store of mails, shared by feeds. */
+static int dedup_dirfd = -1;
+/* Content-addressed cache of images, shared by feeds. */
+static int images_dirfd = -1;
+
+static struct outbox_mail *outbox;
+static size_t *outbox_index;
+static size_t outbox_size;
+static size_t outbox_alloc;
+
+/* Digest of the feed being processed. Outbox is folded into it. */
+static struct {
+	/* Headers, started by the first new entry. */
+	struct mail mail;
+} digest;
 
-	xmlFree(e->date);
-	xmlFree(e->id);
-	xmlFree(e->lang);
-	xmlFree(e->link);
-	xmlFree(e->subject);
-	xmlFree(e->text.content);
-}
+/*
+ * Entries of the feed being processed that have been delivered as part of a
+ * digest or dropped by a filter, so they are not handled again.
+ */
+static struct {
+	/* Sorted names read from the index file. */
+	HASH *old;
+	size_t nold;
+	/* Names of entries for the index after delivery. */
+	HASH *names;
+	size_t nnames;
+	size_t alloc;
+	/* Some names are not in old. */
+	int changed;
+	/* Empty if index is not kept. */
+	char path[PATH_MAX];
+} entry_index;
 
-static void
+void
 msg(int priority, char const *format, ...)
 {
 	switch (priority) {
@@ -102,6 +265,8 @@ msg(int priority, char const *format, ...)
 	fputc('\n', stderr);
 
 	if (LOG_ERR == priority) {
+		/* Stack of the erroring feed is still intact. */
+		feed_release();
 		if (have_errctx) {
 			longjmp(errctx, 1);
 		} else {
@@ -110,6 +275,14 @@ msg(int priority, char const *format, ...)
 	}
 }
 
+static long long
+clock_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
 static void
 xsnprintf(char *buf, size_t buf_size, char const *format, ...)
 {
@@ -130,13 +303,45 @@ xfopen(char const *pathname, char const *mode)
 	return f;
 }
 
+/* Replace trailing XXXXXX of template like mkstemp(). */
+void
+fill_tmpname(char *template)
+{
+	static char const CHARS[] =
+		"abcdefghijklmnopqrstuvwxyz"
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"0123456789";
+	static unsigned long long seq;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	unsigned long long r =
+		(++seq * 0x9e3779b97f4a7c15ULL) ^
+		((unsigned long long)getpid() << 32) ^
+		(unsigned long long)now.tv_nsec;
+
+	char *x = template + strlen(template) - 6;
+	for (int i = 0; i < 6; ++i, r /= sizeof CHARS - 1)
+		x[i] = CHARS[r % (sizeof CHARS - 1)];
+}
+
+/* mkstemp() relative to a directory. */
 static FILE *
-xftmpopen(char *template)
+xftmpopenat(int dirfd, char *template)
 {
-	int fd = mkstemp(template);
-	if (fd < 0)
-		msg(LOG_ERR, "Cannot create temporary file: %s", strerror(errno));
-	return fdopen(fd, "w+");
+	for (int tries = 0; tries < 100; ++tries) {
+		fill_tmpname(template);
+		int fd = openat(dirfd, template,
+				O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+				S_IRUSR | S_IWUSR);
+		if (0 <= fd)
+			return fdopen(fd, "w+");
+		if (EEXIST != errno)
+			break;
+	}
+
+	msg(LOG_ERR, "Cannot create temporary file: %s", strerror(errno));
+	return NULL;
 }
 
 static void
@@ -147,29 +352,92 @@ xfclose(FILE *f, char const *pathname)
 }
 
 static void
-xmkdir(char const *path)
-{
-	if (mkdir(path, S_IRWXU) && EEXIST != errno)
-		msg(LOG_ERR, "Cannot create '%s': %s", path, strerror(errno));
-}
-
-static void
-xrename(char const *old, char const *new)
+xrenameat(int olddirfd, char const *old, int newdirfd, char const *new)
 {
-	if (rename(old, new))
+	if (renameat(olddirfd, old, newdirfd, new))
 		msg(LOG_ERR, "Cannot rename '%s' -> '%s': %s",
 				old, new, strerror(errno));
 }
 
 static void
-xlink(char const *from, char const *to)
+xlinkat(int olddirfd, char const *from, int newdirfd, char const *to)
 {
-	if (link(from, to) && EEXIST != errno)
+	if (linkat(olddirfd, from, newdirfd, to, 0) && EEXIST != errno)
 		msg(LOG_ERR, "Cannot link '%s' -> '%s': %s",
 				from, to, strerror(errno));
-	(void)unlink(from);
+	(void)unlinkat(olddirfd, from, 0);
+}
+
+static void
+tmpfile_release(void *p)
+{
+	struct tmpfile *t = p;
+	if (t->stream)
+		fclose(t->stream);
+	(void)unlinkat(t->dirfd, t->name, 0);
+}
+
+/* Create temporary file that is removed unless committed. */
+static FILE *
+tmpfile_open(struct tmpfile *t, int dirfd, char const *template)
+{
+	t->dirfd = dirfd;
+	xsnprintf(t->name, sizeof t->name, "%s", template);
+	t->stream = xftmpopenat(dirfd, t->name);
+	feed_track(tmpfile_release, t);
+	return t->stream;
+}
+
+/* Close temporary file and move it to its final place. */
+static void
+tmpfile_commit(struct tmpfile *t, int newdirfd, char const *new, int link)
+{
+	FILE *stream = t->stream;
+	t->stream = NULL;
+	xfclose(stream, t->name);
+	if (link)
+		xlinkat(t->dirfd, t->name, newdirfd, new);
+	else
+		xrenameat(t->dirfd, t->name, newdirfd, new);
+	feed_untrack(t);
+}
+
+/* Flush file to disk. If whole_fs, everything on its file system. */
+static void
+xfsync(FILE *f, char const *pathname, int whole_fs)
+{
+	if (fflush(f) ||
+	    (whole_fs ? syncfs(fileno(f)) : fsync(fileno(f))))
+		msg(LOG_ERR, "Cannot sync '%s': %s", pathname, strerror(errno));
+}
+
+static void
+xfsyncdirat(int dirfd, char const *path)
+{
+	/* O_PATH descriptors cannot be synced. */
+	int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fsync(fd)) {
+		int err = errno;
+		if (0 <= fd)
+			close(fd);
+		msg(LOG_ERR, "Cannot sync '%s': %s", path, strerror(err));
+	}
+	close(fd);
+}
+
+static int
+xopendirat(int dirfd, char const *path)
+{
+	if (mkdirat(dirfd, path, S_IRWXU) && EEXIST != errno)
+		msg(LOG_ERR, "Cannot create '%s': %s", path, strerror(errno));
+
+	int fd = openat(dirfd, path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		msg(LOG_ERR, "Cannot open '%s': %s", path, strerror(errno));
+	return fd;
 }
 
+
 static int
 xfgets(char *s, int size, FILE *stream)
 {
@@ -231,8 +499,8 @@ parse_date(char const *s)
 	return 0;
 }
 
-static void
-hash_from_sha1(HASH hash, BYTE bytes[static 16])
+void
+hash_from_sha1(HASH hash, BYTE const bytes[static 16])
 {
 	static char const HEX[16] = "0123456789abcdef";
 
@@ -261,7 +529,7 @@ hash_str(HASH hash, char const *s)
 
 	sha1_update_strnull(&ctx, s);
 
-	BYTE bytes[16];
+	BYTE bytes[SHA1_BLOCK_SIZE];
 	sha1_final(&ctx, bytes);
 	hash_from_sha1(hash, bytes);
 }
@@ -283,595 +551,3421 @@ hash_entry(HASH hash, struct entry const *e, int with_content)
 	if (e->feed)
 		sha1_update_strnull(&ctx, (char const *)e->feed->link);
 
-	BYTE bytes[16];
+	BYTE bytes[SHA1_BLOCK_SIZE];
 	sha1_final(&ctx, bytes);
 	hash_from_sha1(hash, bytes);
 }
 
+/* Same entry carried by different feeds hashes the same. */
 static void
-mail_create(struct mail *mail)
+hash_entry_content(HASH hash, struct entry const *e)
 {
-	strcpy(mail->path, MAIL_TMPNAME);
-	mail->stream =  xftmpopen(mail->path);
+	SHA1_CTX ctx;
+	sha1_init(&ctx);
+
+	sha1_update_strnull(&ctx, (char const *)e->id);
+	sha1_update_strnull(&ctx, (char const *)e->link);
+	sha1_update_strnull(&ctx, (char const *)e->text.content);
+
+	BYTE bytes[SHA1_BLOCK_SIZE];
+	sha1_final(&ctx, bytes);
+	hash_from_sha1(hash, bytes);
 }
 
 static void
-mail_commit(struct mail *mail, char const *name, int new)
+mail_release(void *p)
 {
-	xfclose(mail->stream, mail->path);
-
-	char new_path[PATH_MAX];
-	xsnprintf(new_path, sizeof new_path,
-			new
-				? "new/0.%s.localhost"
-				: "cur/0.%s.localhost:2,S",
-			name);
-	xlink(mail->path, new_path);
+	struct mail *mail = p;
+	if (mail->stream)
+		fclose(mail->stream);
+	free(mail->data);
+	free(mail->html);
 }
 
-static enum rfc822_type
-rfc822_classify(unsigned char const *s)
+static void
+mail_create(struct mail *mail)
 {
-	enum rfc822_type ret = RFC822_ATOM;
-	for (; *s; ++s) {
-		enum rfc822_type t;
-		if (' ' < *s && *s <= '~')
-			t = RFC822_ATOM;
-		else if (*s <= '~' && !('\r' == s[0] && '\n' == s[1])) {
-			t = RFC822_TEXT;
-		} else
-			t = RFC822_NONASCII;
+	mail->data = NULL;
+	mail->html = NULL;
+	mail->folder = NULL;
+	mail->stream = open_memstream(&mail->data, &mail->size);
+	if (!mail->stream)
+		msg(LOG_ERR, "Cannot create mail: %s", strerror(errno));
+	feed_track(mail_release, mail);
+}
 
-		if (ret < t)
-			ret = t;
-	}
-	return ret;
+static int
+hash_cmp(void const *a, void const *b)
+{
+	return strcmp(a, b);
 }
 
-/* "Q"-encoding. */
 static void
-rfc2047_write_qenc(unsigned char const *s, FILE *stream)
+digest_clear(void)
 {
-	static char const HEX[16] = "0123456789ABCDEF";
-
-	fwrite("=?UTF-8?Q?", 1, 10, stream);
-	for (; *s; ++s) {
-		if (' ' == *s) {
-			fputc('_', stream);
-		} else if (('0' <= *s && *s <= '9') ||
-		           ('a' <= *s && *s <= 'z') ||
-		           ('A' <= *s && *s <= 'Z') ||
-		           '+' == *s || '-' == *s)
-		{
-			fputc(*s, stream);
-		} else {
-			fputc('=', stream);
-			fputc(HEX[*s >> 4], stream);
-			fputc(HEX[*s & 0xf], stream);
-		}
-	}
-	fwrite("?=", 1, 2, stream);
+	if (digest.mail.stream)
+		fclose(digest.mail.stream);
+	free(digest.mail.data);
+	free(digest.mail.html);
+	memset(&digest, 0, sizeof digest);
 }
 
 static void
-rfc822_write_quoted(unsigned char const *s, FILE *stream)
+entry_index_clear(void)
 {
-	fputc('"', stream);
-	for (; *s; ++s) {
-		if ('"' == *s || '\\' == *s || '\r' == *s)
-			fputc('\\', stream);
-		fputc(*s, stream);
-	}
-	fputc('"', stream);
+	free(entry_index.old);
+	free(entry_index.names);
+	memset(&entry_index, 0, sizeof entry_index);
 }
 
-/*
- * Format specifiers:
- * %s: Unrestricted NUL terminated string.
- * %t: Text.
- * %w: Word.
- */
 static void
-mail_write_hdr(struct mail *mail, char const *fmt, ...)
+outbox_clear(void)
 {
-	va_list ap;
-
-	va_start(ap, fmt);
-	for (char const *s = fmt; (s = strchr(s, '%'));) {
-		s += 2; /* %X */
-		unsigned char const *arg = va_arg(ap, unsigned char *);
-		if (!arg) {
-			va_end(ap);
-			return;
-		}
+	for (size_t i = 0; i < outbox_size; ++i) {
+		free(outbox[i].data);
+		free(outbox[i].html);
 	}
-	va_end(ap);
-
-	va_start(ap, fmt);
-	for (char const *s = fmt;;) {
-		char const *from = s;
-		s = strchr(from, '%');
-		if (!s)
-			s = from + strlen(from);
-
-		size_t len = (size_t)(s - from);
-		fwrite(from, 1, len, mail->stream);
-		if (!*s)
-			break;
-
-		enum rfc822_type allow;
-		switch (s[1]) {
-		case 's': allow = RFC822_NONASCII; break;
-		case 't': allow = RFC822_TEXT; break;
-		case 'w': allow = RFC822_ATOM; break;
-		default: abort();
-		}
-
-		char const *arg = va_arg(ap, char *);
-		enum rfc822_type type = rfc822_classify((unsigned char *)arg);
+	if (outbox_index)
+		memset(outbox_index, 0, 2 * outbox_alloc * sizeof *outbox_index);
+	outbox_size = 0;
+	digest_clear();
+	entry_index_clear();
+}
 
-		if (type <= allow) {
-			fputs(arg, mail->stream);
-		} else switch (type) {
-		case RFC822_TEXT:
-			rfc822_write_quoted((unsigned char *)arg, mail->stream);
-			break;
+static int
+folder_eq(char const *a, char const *b)
+{
+	return a == b || (a && b && !strcmp(a, b));
+}
 
-		case RFC822_NONASCII:
-			rfc2047_write_qenc((unsigned char *)arg, mail->stream);
-			break;
+/* Slot of name in outbox_index. Empty if name is not queued for folder. */
+static size_t *
+outbox_find(char const *name, char const *folder)
+{
+	size_t mask = 2 * outbox_alloc - 1;
+	for (size_t i = strtoull(name, NULL, 16) & mask;; i = (i + 1) & mask) {
+		size_t *slot = &outbox_index[i];
+		if (!*slot ||
+		    (!strcmp(outbox[*slot - 1].name, name) &&
+		     folder_eq(outbox[*slot - 1].folder, folder)))
+			return slot;
+	}
+}
 
-		default:
-			abort();
-		}
+static void
+outbox_grow(void)
+{
+	size_t n = outbox_alloc ? 2 * outbox_alloc : 16;
+	struct outbox_mail *p = realloc(outbox, n * sizeof *p);
+	if (!p)
+		msg(LOG_ERR, "Cannot allocate memory");
+	outbox = p;
+
+	/* Keep it at most half full. */
+	size_t *index = calloc(2 * n, sizeof *index);
+	if (!index)
+		msg(LOG_ERR, "Cannot allocate memory");
+	free(outbox_index);
+	outbox_index = index;
+	outbox_alloc = n;
+
+	for (size_t i = 0; i < outbox_size; ++i)
+		*outbox_find(outbox[i].name, outbox[i].folder) = i + 1;
+}
 
-		s += 2; /* %s */
-	}
-	va_end(ap);
+/*
+ * Names of mails flushed by the current import so later snapshots do not
+ * queue them again. Open addressing, kept at most half full.
+ */
+static HASH *delivered;
+static size_t ndelivered;
+static size_t delivered_alloc;
 
-	fputc('\n', mail->stream);
+static HASH *
+delivered_find(char const *name)
+{
+	size_t mask = delivered_alloc - 1;
+	for (size_t i = strtoull(name, NULL, 16) & mask;; i = (i + 1) & mask)
+		if (!*delivered[i] || !strcmp(delivered[i], name))
+			return &delivered[i];
 }
 
-static char *
-get_domain(char **url)
+static void
+delivered_add(char const *name)
 {
-	if (!*url) {
-		*url = (char *)"localhost";
-		return NULL;
+	if (delivered_alloc <= 2 * ndelivered) {
+		size_t n = delivered_alloc ? 2 * delivered_alloc : 64;
+		HASH *p = calloc(n, sizeof *p);
+		if (!p)
+			msg(LOG_ERR, "Cannot allocate memory");
+
+		HASH *old = delivered;
+		size_t old_alloc = delivered_alloc;
+		delivered = p;
+		delivered_alloc = n;
+		for (size_t i = 0; i < old_alloc; ++i)
+			if (*old[i])
+				strcpy(*delivered_find(old[i]), old[i]);
+		free(old);
 	}
 
-	char *slash = NULL;
-	char *s = strstr(*url, "://");
-	if (s) {
-		*url = s + 3;
-		slash = strchr(*url, '/');
-		if (slash)
-			*slash = '\0';
+	HASH *slot = delivered_find(name);
+	if (!**slot) {
+		strcpy(*slot, name);
+		++ndelivered;
 	}
-	return slash;
 }
 
 static void
-mail_write_from_hdr(struct mail *mail, struct entry const *feed)
+delivered_clear(void)
 {
-	char *phrase = NULL;
-	char *addr_spec = NULL;
-
-	if (*opt_from)
-		phrase = opt_from;
-	else
-		phrase = (char *)feed->subject;
-	addr_spec = (char *)feed->link;
-
-	char *slash = get_domain(&addr_spec);
-	if (phrase)
-		mail_write_hdr(mail, "From: %w <feed@%s>", phrase, addr_spec);
-	else
-		mail_write_hdr(mail, "From: feed@%s", addr_spec);
-	if (slash)
-		*slash = '/';
+	free(delivered);
+	delivered = NULL;
+	ndelivered = 0;
+	delivered_alloc = 0;
 }
 
+/* Queue mail for delivery. Mails are delivered together by outbox_flush(). */
 static void
-mail_write_feed_msgid_hdr(struct mail *mail, char const *name, struct entry const *feed)
+mail_commit(struct mail *mail, char const *id, char const *name,
+		char const *content, int new)
 {
-	HASH id;
-	hash_entry(id, feed, 1);
+	TRACE_BEGIN("mail_commit");
+
+	FILE *stream = mail->stream;
+	mail->stream = NULL;
+	xfclose(stream, "mail");
+
+	if (outbox_alloc <= outbox_size)
+		outbox_grow();
+
+	/*
+	 * Root mail is regenerated for every new entry. Imported snapshots
+	 * repeat entries.
+	 */
+	size_t *slot = outbox_find(name, mail->folder);
+	if (*slot || (delivered_alloc && **delivered_find(name))) {
+		feed_untrack(mail);
+		free(mail->data);
+		free(mail->html);
+		if (new)
+			++stats.entries_duplicate;
+		else
+			++stats.root_mails_skipped;
+		TRACE_END();
+		return;
+	}
 
-	char *s = (char *)feed->link;
-	char *slash = get_domain(&s);
-	mail_write_hdr(mail, "%s: <%s@%s>", name, id, s);
-	if (slash)
-		*slash = '/';
+	feed_untrack(mail);
+	*slot = outbox_size + 1;
+	struct outbox_mail *m = &outbox[outbox_size++];
+	strcpy(m->name, name);
+	strcpy(m->id, id);
+	strcpy(m->content, content);
+	m->new = new;
+	m->data = mail->data;
+	m->size = mail->size;
+	m->html = mail->html;
+	m->folder = mail->folder;
+
+	TRACE_END();
 }
 
-static int
-entry_has_author(struct entry const *e, struct entry_author const *author)
-{
-	for (struct entry_author const *x = e->authors;
-	      ARRAY_IN(e->authors, x);
-	      ++x)
-		if (x->name &&
-		    author->name &&
-		    !xmlStrcmp(x->name, author->name))
-			return 1;
-	return 0;
+static void
+maildir_close(struct maildir *md)
+{
+	if (!md->used)
+		return;
+	md->used = 0;
+	close(md->tmp);
+	close(md->new);
+	close(md->cur);
 }
 
 static void
-mail_write_author_hdr(struct mail *mail, struct entry const *e)
+maildir_close_all(void)
 {
-	for (struct entry_author const *author = e->authors;
-	      ARRAY_IN(e->authors, author);
-	      ++author)
-	{
-		if (e->feed && entry_has_author(e->feed, author))
-			continue;
+	for (struct maildir *md = maildirs; ARRAY_IN(maildirs, md); ++md)
+		maildir_close(md);
 
-		if (author->name && author->email)
-			mail_write_hdr(mail, "Author: %t <%t>",
-					author->name, author->email);
-		else if (author->name)
-			mail_write_hdr(mail, "Author: %t",
-					author->name);
-	}
-}
+	if (0 <= dedup_dirfd)
+		close(dedup_dirfd);
+	dedup_dirfd = -1;
 
-static int
-entry_has_category(struct entry const *e, struct entry_category const *category)
-{
-	for (struct entry_category const *x = e->categories;
-	      ARRAY_IN(e->categories, x);
-	      ++x)
-		if (x->name &&
-		    category->name &&
-		    !xmlStrcmp(x->name, category->name))
-			return 1;
-	return 0;
+	if (0 <= images_dirfd)
+		close(images_dirfd);
+	images_dirfd = -1;
 }
 
-static void
-mail_write_category_hdr(struct mail *mail, struct entry const *e)
+/*
+ * Remove temporary files left behind by killed runs. As usual for Maildir,
+ * files are stale after 36 hours so running instances are not disturbed.
+ */
+static void
+maildir_sweep(int tmpfd)
 {
-	for (struct entry_category const *category = e->categories;
-	      ARRAY_IN(e->categories, category);
-	      ++category)
-	{
-		if (e->feed && entry_has_category(e->feed, category))
-			continue;
+	int fd = openat(tmpfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = 0 <= fd ? fdopendir(fd) : NULL;
+	if (!dir) {
+		if (0 <= fd)
+			close(fd);
+		return;
+	}
+
+	time_t stale = time(NULL) - 36 * 60 * 60;
+	for (struct dirent *d; (d = readdir(dir));) {
+		struct stat st;
+		if (!strncmp(d->d_name, "mrss", 4) &&
+		    !fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) &&
+		    S_ISREG(st.st_mode) && st.st_mtime < stale)
+		{
+			msg(LOG_INFO, "Removing stale '%s'", d->d_name);
+			(void)unlinkat(fd, d->d_name, 0);
+		}
+	}
+	closedir(dir);
+}
+
+/* Open (and create) Maildir++ folder. Empty folder means INBOX. */
+static struct maildir *
+maildir_open(char const *folder)
+{
+	for (struct maildir *md = maildirs; ARRAY_IN(maildirs, md); ++md)
+		if (md->used && !strcmp(md->folder, folder))
+			return md;
+
+	size_t victim = maildirs_next++ % (sizeof maildirs / sizeof *maildirs);
+	struct maildir *md = &maildirs[victim];
+	maildir_close(md);
+
+	char path[PATH_MAX] = ".";
+	if (*folder) {
+		xsnprintf(path, sizeof path, ".%s", folder);
+		for (char *s = path; (s = strchr(s, '/'));)
+			*s = '.';
+	}
 
-		if (category->name)
-			mail_write_hdr(mail, "X-Category: %t",
-					category->name);
+	int dirfd = xopendirat(AT_FDCWD, path);
+	md->tmp = xopendirat(dirfd, "tmp");
+	maildir_sweep(md->tmp);
+	md->new = xopendirat(dirfd, "new");
+	md->cur = xopendirat(dirfd, "cur");
+	if (*folder) {
+		int fd = openat(dirfd, "maildirfolder",
+				O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (0 <= fd)
+			close(fd);
 	}
+	close(dirfd);
+
+	strcpy(md->folder, folder);
+	md->used = 1;
+	return md;
 }
 
 static void
-generate_root_mail(struct entry const *feed)
+maildir_mail_name(char *buf, size_t buf_size, struct outbox_mail const *m)
 {
-	if (!opt_reply_to)
-		return;
+	xsnprintf(buf, buf_size,
+			m->new
+				? "0.%s.localhost"
+				: "0.%s.localhost:2,S",
+			m->name);
+}
 
-	struct mail mail;
-	mail_create(&mail);
+/*
+ * Stored mails that are linked only from the store are not in any Maildir
+ * anymore.
+ */
+static void
+dedup_sweep(void)
+{
+	int fd = openat(dedup_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = 0 <= fd ? fdopendir(fd) : NULL;
+	if (!dir) {
+		if (0 <= fd)
+			close(fd);
+		return;
+	}
 
-	mail_write_feed_msgid_hdr(&mail, "Message-ID", feed);
-	mail_write_from_hdr(&mail, feed);
-	mail_write_hdr(&mail, "Subject: %t", feed->subject);
-	mail_write_hdr(&mail, "Link: %t", feed->link);
-	if (feed->text.content) {
-		mail_write_hdr(&mail, "Content-Type: %s", feed->text.mime_type);
-		fprintf(mail.stream, "\n%s", (char const *)feed->text.content);
+	for (struct dirent *d; (d = readdir(dir));) {
+		struct stat st;
+		if ('.' != *d->d_name &&
+		    !fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) &&
+		    S_ISREG(st.st_mode) && st.st_nlink <= 1)
+			(void)unlinkat(fd, d->d_name, 0);
 	}
+	closedir(dir);
+}
 
-	HASH id;
-	hash_entry(id, feed, 1);
-	mail_commit(&mail, id, 0);
+/*
+ * Move mail to the front of the first *n mails. Mails behind are already
+ * handled, their data is freed.
+ */
+static void
+mails_keep(struct outbox_mail *mails, size_t *n, struct outbox_mail *m)
+{
+	struct outbox_mail t = mails[*n];
+	mails[(*n)++] = *m;
+	*m = t;
+}
+
+static void
+mails_drop(struct outbox_mail *m)
+{
+	free(m->data);
+	m->data = NULL;
 }
 
+/* Hardlink mails that are already stored. Others are left in mails. */
 static size_t
-header_cb(char *buf, size_t size, size_t nmemb, void *userdata)
+dedup_link(struct maildir const *md, struct outbox_mail *mails, size_t *nmails)
 {
-	(void)userdata;
+	if (dedup_dirfd < 0) {
+		dedup_dirfd = xopendirat(AT_FDCWD, DEDUP_DIR);
+		dedup_sweep();
+	}
 
-	size *= nmemb;
+	size_t n = 0;
+	for (size_t i = 0; i < *nmails; ++i) {
+		struct outbox_mail *m = &mails[i];
+		char name[PATH_MAX];
+		maildir_mail_name(name, sizeof name, m);
+		if (*m->content &&
+		    (!linkat(dedup_dirfd, m->content, m->new ? md->new : md->cur, name, 0) ||
+		     EEXIST == errno))
+		{
+			mails_drop(m);
+			continue;
+		}
+		mails_keep(mails, &n, m);
+	}
 
-	if (curl_strnequal(buf, "etag:", 5)) {
-		size_t n = size - 5 - 2 /* CRLF */;
-		if (n <= sizeof new_state.etag - 1 /* NUL */) {
-			memcpy(new_state.etag, buf + 5, n);
-			new_state.etag[n] = '\0';
+	size_t nlinked = *nmails - n;
+	*nmails = n;
+	return nlinked;
+}
+
+/* Add delivered mails to the store. */
+static void
+dedup_store(struct maildir const *md, struct outbox_mail const *mails,
+		size_t nmails)
+{
+	for (size_t i = 0; i < nmails; ++i) {
+		struct outbox_mail const *m = &mails[i];
+		if (!*m->content)
+			continue;
+
+		char name[PATH_MAX];
+		maildir_mail_name(name, sizeof name, m);
+		/* Mail may be already moved by the reader. */
+		(void)linkat(m->new ? md->new : md->cur, name,
+				dedup_dirfd, m->content, 0);
+	}
+}
+
+static void
+maildir_deliver(struct maildir const *md, struct outbox_mail const *m)
+{
+	struct tmpfile t;
+	FILE *f = tmpfile_open(&t, md->tmp, MAIL_TMPNAME);
+	fwrite(m->data, 1, m->size, f);
+	if (DURABILITY_STRICT <= opt_durability)
+		xfsync(f, t.name, 0);
+
+	char name[PATH_MAX];
+	maildir_mail_name(name, sizeof name, m);
+	tmpfile_commit(&t, m->new ? md->new : md->cur, name, 1);
+}
+
+#ifdef HAVE_IO_URING
+enum {
+	URING_WRITE,
+	URING_FSYNC,
+	URING_LINK,
+	URING_UNLINK,
+	URING_CLOSE,
+	URING_NOPS,
+};
+
+#define URING_BATCH 64
+
+struct uring_mail {
+	char tmpname[sizeof MAIL_TMPNAME];
+	char name[64];
+	int fd;
+	int res[URING_NOPS];
+};
+
+static struct uring ring;
+static int ring_state; /* 0: Uninitialized, 1: Usable, -1: Unavailable. */
+
+static int
+maildir_uring_setup(void)
+{
+	static unsigned char const OPS[] = {
+		IORING_OP_OPENAT,
+		IORING_OP_WRITE,
+		IORING_OP_FSYNC,
+		IORING_OP_LINKAT,
+		IORING_OP_UNLINKAT,
+		IORING_OP_CLOSE,
+	};
+
+	if (ring_state)
+		return 0 < ring_state;
+
+	ring_state = -1;
+	int rc = uring_init(&ring, URING_BATCH * URING_NOPS);
+	if (rc < 0) {
+		msg(LOG_INFO, "io_uring is not available: %s", strerror(-rc));
+	} else if (!uring_supports(&ring, OPS, sizeof OPS)) {
+		msg(LOG_INFO, "io_uring does not support required operations");
+		uring_exit(&ring);
+	} else {
+		ring_state = 1;
+	}
+	return 0 < ring_state;
+}
+
+static struct io_uring_sqe *
+maildir_uring_sqe(int opcode, int fd, unsigned flags, unsigned long long user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->flags = flags;
+	sqe->user_data = user_data;
+	return sqe;
+}
+
+/* Submit queued operations and wait for all n of them. */
+static void
+maildir_uring_wait(unsigned n, struct uring_mail *um, int open)
+{
+	int rc = uring_submit_and_wait(&ring, n);
+	if (rc < 0)
+		msg(LOG_ERR, "io_uring error: %s", strerror(-rc));
+
+	struct io_uring_cqe cqe;
+	for (; n && uring_peek_cqe(&ring, &cqe); --n)
+		if (open)
+			um[cqe.user_data].fd = cqe.res;
+		else
+			um[cqe.user_data / URING_NOPS].res[cqe.user_data % URING_NOPS] = cqe.res;
+}
+
+/*
+ * Create all files at once, then write, link, unlink and close them. Link is
+ * only made after the whole content has been written.
+ */
+static void
+maildir_deliver_uring_batch(struct maildir const *md,
+		struct outbox_mail const *mails, size_t nmails)
+{
+	struct uring_mail um[URING_BATCH];
+	int strict = DURABILITY_STRICT <= opt_durability;
+
+	for (size_t i = 0; i < nmails; ++i) {
+		memset(um[i].res, 0, sizeof um[i].res);
+		strcpy(um[i].tmpname, MAIL_TMPNAME);
+		fill_tmpname(um[i].tmpname);
+		maildir_mail_name(um[i].name, sizeof um[i].name, &mails[i]);
+
+		struct io_uring_sqe *sqe =
+			maildir_uring_sqe(IORING_OP_OPENAT, md->tmp, 0, i);
+		sqe->addr = (uintptr_t)um[i].tmpname;
+		sqe->len = S_IRUSR | S_IWUSR;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+	}
+	maildir_uring_wait(nmails, um, 1);
+
+	unsigned n = 0;
+	for (size_t i = 0; i < nmails; ++i) {
+		if (um[i].fd < 0)
+			continue;
+		unsigned long long id = i * URING_NOPS;
+
+		struct io_uring_sqe *sqe;
+		sqe = maildir_uring_sqe(IORING_OP_WRITE, um[i].fd,
+				IOSQE_IO_LINK, id + URING_WRITE);
+		sqe->addr = (uintptr_t)mails[i].data;
+		sqe->len = mails[i].size;
+
+		if (strict)
+			maildir_uring_sqe(IORING_OP_FSYNC, um[i].fd,
+					IOSQE_IO_LINK, id + URING_FSYNC);
+
+		sqe = maildir_uring_sqe(IORING_OP_LINKAT, md->tmp,
+				IOSQE_IO_HARDLINK, id + URING_LINK);
+		sqe->addr = (uintptr_t)um[i].tmpname;
+		sqe->len = mails[i].new ? md->new : md->cur;
+		sqe->addr2 = (uintptr_t)um[i].name;
+
+		sqe = maildir_uring_sqe(IORING_OP_UNLINKAT, md->tmp,
+				IOSQE_IO_HARDLINK, id + URING_UNLINK);
+		sqe->addr = (uintptr_t)um[i].tmpname;
+
+		maildir_uring_sqe(IORING_OP_CLOSE, um[i].fd,
+				0, id + URING_CLOSE);
+
+		n += URING_NOPS - !strict;
+	}
+	maildir_uring_wait(n, um, 0);
+
+	int err = 0;
+	for (size_t i = 0; i < nmails; ++i) {
+		if (-EEXIST == um[i].fd) {
+			maildir_deliver(md, &mails[i]);
+			continue;
+		} else if (um[i].fd < 0) {
+			err = -um[i].fd;
+			continue;
+		}
+
+		/* Rest of the chain is cancelled after a failed write. */
+		if (-ECANCELED == um[i].res[URING_CLOSE])
+			close(um[i].fd);
+		if (-ECANCELED == um[i].res[URING_UNLINK])
+			(void)unlinkat(md->tmp, um[i].tmpname, 0);
+
+		if (um[i].res[URING_WRITE] < 0)
+			err = -um[i].res[URING_WRITE];
+		else if ((size_t)um[i].res[URING_WRITE] != mails[i].size)
+			err = ENOSPC;
+		else if (um[i].res[URING_FSYNC] < 0)
+			err = -um[i].res[URING_FSYNC];
+		else if (um[i].res[URING_LINK] < 0 && -EEXIST != um[i].res[URING_LINK])
+			err = -um[i].res[URING_LINK];
+	}
+	if (err)
+		msg(LOG_ERR, "Cannot write mail: %s", strerror(err));
+}
+
+/* Returns whether mails could be delivered using io_uring. */
+static int
+maildir_deliver_uring(struct maildir const *md,
+		struct outbox_mail const *mails, size_t nmails)
+{
+	if (!opt_io_uring || !maildir_uring_setup())
+		return 0;
+
+	for (size_t i = 0; i < nmails; i += URING_BATCH)
+		maildir_deliver_uring_batch(md, mails + i,
+				nmails - i < URING_BATCH ? nmails - i : URING_BATCH);
+	return 1;
+}
+#endif
+
+/*
+ * Return value of the next src attribute of an <img> tag, up to *end.
+ * NULL if there is none.
+ */
+static char const *
+html_next_img_src(char const *s, char const **end)
+{
+	static char const SPACE[] = " \t\r\n";
+
+	while ((s = strchr(s, '<'))) {
+		++s;
+		if (strncasecmp(s, "img", 3) || !strchr(SPACE, s[3]) || !s[3])
+			continue;
+
+		for (s += 3; *s && '>' != *s;) {
+			s += strspn(s, " \t\r\n/");
+			char const *name = s;
+			s += strcspn(s, " \t\r\n/=>");
+			size_t n = s - name;
+			s += strspn(s, SPACE);
+			if ('=' != *s) {
+				if (!n && *s && '>' != *s)
+					++s;
+				continue;
+			}
+			s += 1 + strspn(s + 1, SPACE);
+
+			char const *value = s;
+			if ('"' == *s || '\'' == *s) {
+				char quote[] = { *s, '\0' };
+				value = ++s;
+				s += strcspn(s, quote);
+				*end = s;
+				if (*s)
+					++s;
+			} else {
+				s += strcspn(s, " \t\r\n>");
+				*end = s;
+			}
+
+			if (3 == n && !strncasecmp(name, "src", 3))
+				return value;
+		}
+	}
+	return NULL;
+}
+
+/* URL of attribute value. Only "&amp;" is expected in practice. */
+static char *
+html_attr_url(char const *s, char const *end)
+{
+	char *url = malloc(end - s + 1), *d = url;
+	if (!url)
+		msg(LOG_ERR, "Cannot allocate memory");
+	while (s < end) {
+		if (5 <= end - s && !strncmp(s, "&amp;", 5)) {
+			*d++ = '&';
+			s += 5;
 		} else {
-			msg(LOG_WARNING, "Response ETag is ignored because too long");
+			*d++ = *s++;
 		}
 	}
+	*d = '\0';
+	return url;
+}
 
-	if (curl_strnequal(buf, "expires:", 8))
-		new_state.expiration = parse_date(buf + 8);
+static int
+image_cmp(void const *a, void const *b)
+{
+	return strcmp(((struct image const *)a)->url,
+			((struct image const *)b)->url);
+}
 
-	if (curl_strnequal(buf, "last-modified:", 14))
-		new_state.last_modified = parse_date(buf + 14);
+struct image_list {
+	struct image *items;
+	size_t n;
+	size_t alloc;
+};
 
-	return size;
+static void
+image_list_release(void *p)
+{
+	struct image_list *list = p;
+	for (size_t i = 0; i < list->n; ++i)
+		free((char *)list->items[i].url);
+	free(list->items);
 }
 
-static size_t
-write_xml(char *buf, size_t size, size_t nmemb, void *userdata)
+static struct image const *
+image_list_find(struct image_list const *list, char const *s, char const *end)
 {
-	xmlParserCtxtPtr *xml = userdata;
+	struct image key = { .url = html_attr_url(s, end) };
+	struct image const *image = bsearch(&key, list->items, list->n,
+			sizeof *list->items, image_cmp);
+	free((char *)key.url);
+	return image && *image->blob ? image : NULL;
+}
 
-	size *= nmemb;
+/* Rewrite body of m to reference inlined images and append them. */
+static void
+outbox_render_mail(struct outbox_mail *m, struct image_list const *images)
+{
+	struct image const *parts[MAX_MAIL_IMAGES];
+	size_t nparts = 0;
 
-	if (!*xml) {
-		*xml = xmlCreatePushParserCtxt(NULL, NULL, buf, size, NULL);
-		if (!*xml)
-			/* XXX: Should ensure that we have enough bytes to kickstart. */
-			msg(LOG_ERR, "Invalid XML");
+	char *body;
+	size_t body_size;
+	FILE *stream = open_memstream(&body, &body_size);
+	if (!stream)
+		msg(LOG_ERR, "Cannot create mail: %s", strerror(errno));
+
+	char const *s = m->html, *end;
+	for (char const *src = m->html; (src = html_next_img_src(src, &end)); src = end) {
+		struct image const *image = image_list_find(images, src, end);
+		if (!image)
+			continue;
+
+		size_t i = 0;
+		while (i < nparts && strcmp(parts[i]->blob, image->blob))
+			++i;
+		if (i == nparts) {
+			if (MAX_MAIL_IMAGES <= nparts)
+				continue;
+			parts[nparts++] = image;
+		}
+
+		fwrite(s, 1, src - s, stream);
+		fprintf(stream, "cid:%s@mrss", image->blob);
+		s = end;
+	}
+	fputs(s, stream);
+	xfclose(stream, "mail");
+
+	char *data;
+	size_t size;
+	stream = open_memstream(&data, &size);
+	if (!stream) {
+		free(body);
+		msg(LOG_ERR, "Cannot create mail: %s", strerror(errno));
+	}
+	fwrite(m->data, 1, m->size, stream);
+	if (!nparts) {
+		fprintf(stream, "Content-Type: %s\n%s", MIME_TEXT_HTML, m->html);
 	} else {
-		if (xmlParseChunk(*xml, buf, size, 0 /* Terminate? */))
-			msg(LOG_ERR, "Invalid XML");
+		fprintf(stream,
+				"MIME-Version: 1.0\n"
+				"Content-Type: multipart/related; type=\"text/html\"; boundary=\"=_mrss_%s\"\n"
+				"\n"
+				"--=_mrss_%s\n"
+				"Content-Type: %s\n"
+				"%s\n",
+				m->name, m->name, MIME_TEXT_HTML, body);
+		for (size_t i = 0; i < nparts; ++i) {
+			fprintf(stream, "--=_mrss_%s\n", m->name);
+			if (!images_write_part(stream, images_dirfd, parts[i]))
+				fputc('\n', stream);
+		}
+		fprintf(stream, "--=_mrss_%s--\n", m->name);
+	}
+	free(body);
+	if (fclose(stream)) {
+		free(data);
+		msg(LOG_ERR, "Cannot create mail: %s", strerror(errno));
 	}
 
-	return size;
+	free(m->data);
+	m->data = data;
+	m->size = size;
+	free(m->html);
+	m->html = NULL;
 }
 
-void
-entry_process(struct entry const *entry)
+/*
+ * Fetch images referenced by queued mails at once, so each is fetched only
+ * once and transfers run in parallel.
+ */
+static void
+outbox_render(void)
 {
-	struct entry const *feed = entry->feed;
-	msg(LOG_INFO, "Received entry [%s] '%s'", entry->date, entry->subject);
+	struct image_list images = { 0 };
+	feed_track(image_list_release, &images);
 
-	time_t date = 0;
-	if (entry->date) {
-		date = parse_date((char *)entry->date);
+	for (size_t i = 0; i < outbox_size; ++i) {
+		char const *html = outbox[i].html, *end;
+		if (!html)
+			continue;
 
-		if (date <= old_state.last_modified)
-			return;
+		for (char const *src = html; (src = html_next_img_src(src, &end)); src = end) {
+			char *url = html_attr_url(src, end);
+			if (strncmp(url, "http://", 7) && strncmp(url, "https://", 8)) {
+				free(url);
+				continue;
+			}
+
+			if (images.alloc <= images.n) {
+				size_t n = images.alloc ? 2 * images.alloc : 16;
+				struct image *p = realloc(images.items, n * sizeof *p);
+				if (!p) {
+					free(url);
+					msg(LOG_ERR, "Cannot allocate memory");
+				}
+				images.items = p;
+				images.alloc = n;
+			}
+			images.items[images.n++] = (struct image){ .url = url };
+		}
+	}
 
-		if (new_state.last_modified < date)
-			new_state.last_modified = date;
+	if (images.n)
+		qsort(images.items, images.n, sizeof *images.items, image_cmp);
+	size_t n = 0;
+	for (size_t i = 0; i < images.n; ++i)
+		if (n && !strcmp(images.items[n - 1].url, images.items[i].url))
+			free((char *)images.items[i].url);
+		else
+			images.items[n++] = images.items[i];
+	images.n = n;
+
+	if (images.n) {
+		if (images_dirfd < 0)
+			images_dirfd = xopendirat(AT_FDCWD, IMAGES_DIR);
+
+		struct image_options opts = {
+			.proxy = opt_proxy,
+			.user_agent = opt_user_agent,
+			.ttl = opt_image_ttl,
+		};
+		images_fetch(images_dirfd, images.items, images.n, &opts);
 	}
 
-	msg(LOG_INFO, "New");
+	for (size_t i = 0; i < outbox_size; ++i)
+		if (outbox[i].html)
+			outbox_render_mail(&outbox[i], &images);
 
-	generate_root_mail(feed);
+	feed_untrack(&images);
+	image_list_release(&images);
+}
 
-	struct mail mail;
-	mail_create(&mail);
+/* Replace queued mails by a single multipart/digest mail of them. */
+static void
+outbox_digest(void)
+{
+	SHA1_CTX ctx;
+	sha1_init(&ctx);
+	for (size_t i = 0; i < outbox_size; ++i)
+		sha1_update(&ctx, (BYTE const *)outbox[i].name, strlen(outbox[i].name));
+	BYTE bytes[SHA1_BLOCK_SIZE];
+	sha1_final(&ctx, bytes);
+	HASH name;
+	hash_from_sha1(name, bytes);
+
+	struct mail *mail = &digest.mail;
+	fprintf(mail->stream,
+			"Message-ID: <%s@localhost>\n"
+			"MIME-Version: 1.0\n"
+			"Content-Type: multipart/digest; boundary=\"=_mrss_%s\"\n",
+			name, name);
+	for (size_t i = 0; i < outbox_size; ++i) {
+		fprintf(mail->stream, "\n--=_mrss_%s\n\n", name);
+		fwrite(outbox[i].data, 1, outbox[i].size, mail->stream);
+		free(outbox[i].data);
+	}
+	fprintf(mail->stream, "\n--=_mrss_%s--\n", name);
 
+	memset(outbox_index, 0, 2 * outbox_alloc * sizeof *outbox_index);
+	outbox_size = 0;
+	mail_commit(mail, name, name, "", 1);
+	/* Owned by outbox now. */
+	mail->data = NULL;
+}
 
-	char datetime[50];
-	time_t now = time(NULL);
-	strftime(datetime, sizeof datetime, RFC_822, localtime(&now));
-	mail_write_hdr(&mail, "Received: mrss; %s", datetime);
+static void
+entry_index_read(char const *path)
+{
+	xsnprintf(entry_index.path, sizeof entry_index.path, "%s", path);
+
+	FILE *f = fopen(path, "re");
+	if (!f) {
+		if (ENOENT != errno)
+			msg(LOG_ERR, "Cannot open '%s': %s", path, strerror(errno));
+		return;
+	}
+
+	size_t alloc = 0;
+	for (char buf[64]; xfgets(buf, sizeof buf, f);) {
+		if (strlen(buf) != sizeof(HASH) - 1)
+			continue;
+		if (alloc <= entry_index.nold) {
+			alloc = alloc ? 2 * alloc : 64;
+			HASH *p = realloc(entry_index.old, alloc * sizeof *p);
+			if (!p) {
+				fclose(f);
+				msg(LOG_ERR, "Cannot allocate memory");
+			}
+			entry_index.old = p;
+		}
+		strcpy(entry_index.old[entry_index.nold++], buf);
+	}
+	fclose(f);
+
+	if (entry_index.nold)
+		qsort(entry_index.old, entry_index.nold, sizeof *entry_index.old,
+				hash_cmp);
+}
+
+/*
+ * Entries of the feed that have been handled. Entries gone from the feed are
+ * forgotten. Written after delivery, and only if it has changed.
+ */
+static void
+entry_index_write(void)
+{
+	if (!entry_index.changed)
+		return;
+
+	struct tmpfile t;
+	FILE *f = tmpfile_open(&t, maildir_open("")->tmp, "mrssindex.XXXXXX");
+	for (size_t i = 0; i < entry_index.nnames; ++i)
+		fprintf(f, "%s\n", entry_index.names[i]);
+	if (DURABILITY_BATCH <= opt_durability)
+		xfsync(f, t.name, 0);
+	tmpfile_commit(&t, AT_FDCWD, entry_index.path, 0);
+	entry_index.changed = 0;
+}
+
+/* Forget entry whose mail has not been delivered. */
+static void
+entry_index_remove(char const *name)
+{
+	for (size_t i = 0; i < entry_index.nnames; ++i)
+		if (!strcmp(entry_index.names[i], name)) {
+			memmove(entry_index.names[i],
+			        entry_index.names[--entry_index.nnames], sizeof(HASH));
+			return;
+		}
+}
 
+/*
+ * Mails delivered for a feed are logged as "DATE NAME ID FOLDER" lines, where
+ * ID is the hash in Message-ID, so they can be pruned and replaced without
+ * scanning Maildirs.
+ */
+struct logged_mail {
+	long long date;
+	HASH name;
 	HASH id;
-	hash_entry(id, entry, 0);
-	mail_write_hdr(&mail, "Message-ID: <%s@localhost>", id);
-	mail_write_feed_msgid_hdr(&mail, "In-Reply-To", feed);
-	mail_write_hdr(&mail, "Content-Language: %t", entry->lang);
-	mail_write_hdr(&mail, "Content-Transfer-Encoding: binary");
+	char folder[sizeof opt_folder];
+	size_t seq;
+	int keep;
+};
+
+struct mails_log {
+	struct logged_mail *items;
+	size_t n;
+	size_t alloc;
+};
+
+static void
+mails_log_name(char *buf, size_t buf_size)
+{
+	xsnprintf(buf, buf_size, ".mrssmails.%s", stats.id);
+}
+
+static void
+mails_log_release(void *p)
+{
+	struct mails_log *log = p;
+	free(log->items);
+}
+
+/* Return 0 if there is no log. */
+static int
+mails_log_read(struct mails_log *log, char const *logname)
+{
+	FILE *f = fopen(logname, "re");
+	if (!f) {
+		if (ENOENT != errno)
+			msg(LOG_ERR, "Cannot open '%s': %s", logname, strerror(errno));
+		return 0;
+	}
+
+	for (char line[64 + sizeof opt_folder]; xfgets(line, sizeof line, f);) {
+		if (log->alloc <= log->n) {
+			size_t n = log->alloc ? 2 * log->alloc : 64;
+			struct logged_mail *p = realloc(log->items, n * sizeof *p);
+			if (!p) {
+				fclose(f);
+				msg(LOG_ERR, "Cannot allocate memory");
+			}
+			log->items = p;
+			log->alloc = n;
+		}
+
+		struct logged_mail *m = &log->items[log->n];
+		int off;
+		if (3 != sscanf(line, "%lld %16s %16s %n",
+		                &m->date, m->name, m->id, &off) ||
+		    strlen(m->name) != sizeof m->name - 1 ||
+		    strlen(m->id) != sizeof m->id - 1)
+			continue;
+		xsnprintf(m->folder, sizeof m->folder, "%s", line + off);
+		m->seq = log->n++;
+		m->keep = 1;
+	}
+	fclose(f);
+	return 1;
+}
+
+static void
+mails_log_print(FILE *f, char const *folder, struct outbox_mail const *mails,
+		size_t nmails)
+{
+	long long now = time(NULL);
+	for (size_t i = 0; i < nmails; ++i)
+		fprintf(f, "%lld %s %s %s\n",
+				now, mails[i].name, mails[i].id, folder);
+}
+
+static void
+mails_log_append(char const *folder, struct outbox_mail const *mails,
+		size_t nmails)
+{
+	char logname[PATH_MAX];
+	mails_log_name(logname, sizeof logname);
+
+	FILE *f = xfopen(logname, "ae");
+	mails_log_print(f, folder, mails, nmails);
+	if (DURABILITY_BATCH <= opt_durability)
+		xfsync(f, logname, 0);
+	xfclose(f, logname);
+}
+
+/* Mails of the same key replace each other. */
+static int
+logged_mail_cmp_key(void const *a, void const *b)
+{
+	struct logged_mail const *x = a, *y = b;
+	int cmp = strcmp(opt_replace ? x->id : x->name,
+	                 opt_replace ? y->id : y->name);
+	if (!cmp)
+		cmp = strcmp(x->folder, y->folder);
+	return cmp;
+}
+
+static int
+logged_mail_cmp_key_seq(void const *a, void const *b)
+{
+	struct logged_mail const *x = a, *y = b;
+	int cmp = logged_mail_cmp_key(x, y);
+	if (!cmp)
+		cmp = x->seq < y->seq ? -1 : 1;
+	return cmp;
+}
+
+static int
+logged_mail_cmp_seq(void const *a, void const *b)
+{
+	struct logged_mail const *x = a, *y = b;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Mark earlier lines of the same mail. Return number of remaining ones. Log is
+ * left sorted by key.
+ */
+static size_t
+mails_log_supersede(struct mails_log *log)
+{
+	if (log->n)
+		qsort(log->items, log->n, sizeof *log->items, logged_mail_cmp_key_seq);
+	size_t nlive = log->n;
+	for (size_t i = 1; i < log->n; ++i)
+		if (!logged_mail_cmp_key(&log->items[i - 1], &log->items[i])) {
+			log->items[i - 1].keep = 0;
+			--nlive;
+		}
+	return nlive;
+}
+
+/* Replace log with its kept lines followed by mails. */
+static void
+mails_log_rewrite(struct mails_log *log, char const *folder,
+		struct outbox_mail const *mails, size_t nmails)
+{
+	char logname[PATH_MAX];
+	mails_log_name(logname, sizeof logname);
+
+	qsort(log->items, log->n, sizeof *log->items, logged_mail_cmp_seq);
+
+	struct tmpfile t;
+	FILE *f = tmpfile_open(&t, maildir_open("")->tmp, "mrssmails.XXXXXX");
+	for (size_t i = 0; i < log->n; ++i) {
+		struct logged_mail const *m = &log->items[i];
+		if (m->keep)
+			fprintf(f, "%lld %s %s %s\n",
+					m->date, m->name, m->id, m->folder);
+	}
+	mails_log_print(f, folder, mails, nmails);
+	if (DURABILITY_BATCH <= opt_durability)
+		xfsync(f, t.name, 0);
+	tmpfile_commit(&t, AT_FDCWD, logname, 0);
+}
+
+/*
+ * Find delivered mail wherever the reader moved it. Return its directory and
+ * file name in path, or -1.
+ */
+static int
+maildir_find(struct maildir const *md, char const *name,
+		char *path, size_t path_size)
+{
+	static char const FLAGS[] = "DFPRST";
+
+	int n = snprintf(path, path_size, "0.%s.localhost", name);
+	struct stat st;
+	if (!fstatat(md->new, path, &st, AT_SYMLINK_NOFOLLOW))
+		return md->new;
+
+	/*
+	 * Readers append flags in ASCII order. Masks are tried so that the
+	 * usual S and RS come early.
+	 */
+	for (int mask = -1; mask < 1 << 6; ++mask) {
+		char *s = path + n;
+		if (0 <= mask) {
+			s = stpcpy(s, ":2,");
+			for (int i = 0; FLAGS[i]; ++i)
+				if (mask & (1 << (5 - i)))
+					*s++ = FLAGS[i];
+		}
+		*s = '\0';
+
+		if (!fstatat(md->cur, path, &st, AT_SYMLINK_NOFOLLOW))
+			return md->cur;
+	}
+	return -1;
+}
+
+/*
+ * Remove delivered mail. Return 1 if removed, 0 if it is gone already and -1
+ * if it must be kept.
+ */
+static int
+maildir_prune(struct maildir const *md, char const *name)
+{
+	char path[PATH_MAX];
+	int dirfd = maildir_find(md, name, path, sizeof path);
+	if (dirfd < 0)
+		return 0;
+
+	char const *info = strstr(path, ":2,");
+	if (info && strchr(info, 'F'))
+		return -1;
+	if (unlinkat(dirfd, path, 0)) {
+		msg(LOG_WARNING, "Cannot remove '%s': %s", path, strerror(errno));
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Overwrite previous version so readers never see both or none, then give it
+ * the name of the new version keeping its flags.
+ */
+static void
+maildir_replace(struct maildir const *md, int dirfd, char const *path,
+		struct outbox_mail const *m)
+{
+	struct tmpfile t;
+	FILE *f = tmpfile_open(&t, md->tmp, MAIL_TMPNAME);
+	fwrite(m->data, 1, m->size, f);
+	if (DURABILITY_STRICT <= opt_durability)
+		xfsync(f, t.name, 0);
+	tmpfile_commit(&t, dirfd, path, 0);
+
+	char const *info = strstr(path, ":2,");
+	char name[PATH_MAX];
+	xsnprintf(name, sizeof name, "0.%s.localhost%s", m->name, info ? info : "");
+	/* Reader may have moved it meanwhile. */
+	if (renameat(dirfd, path, dirfd, name))
+		msg(LOG_WARNING, "Cannot rename '%s' -> '%s': %s",
+				path, name, strerror(errno));
+}
+
+/*
+ * Replace previous versions of mails in place. Replaced mails are removed from
+ * mails. Lines of log they supersede are marked.
+ */
+static size_t
+maildir_replace_previous(struct maildir const *md, char const *folder,
+		struct mails_log *log, struct outbox_mail *mails, size_t *nmails)
+{
+	char logname[PATH_MAX];
+	mails_log_name(logname, sizeof logname);
+
+	if (opt_replace && mails_log_read(log, logname))
+		mails_log_supersede(log);
+
+	size_t n = 0;
+	for (size_t i = 0; i < *nmails; ++i) {
+		struct outbox_mail *m = &mails[i];
+		struct logged_mail key;
+		strcpy(key.id, m->id);
+		xsnprintf(key.folder, sizeof key.folder, "%s", folder);
+		struct logged_mail *prev = log->n
+			? bsearch(&key, log->items, log->n, sizeof *log->items,
+			          logged_mail_cmp_key)
+			: NULL;
+		/* Run of the same key ends with the current line. */
+		while (prev && prev + 1 < log->items + log->n &&
+		       !logged_mail_cmp_key(prev, prev + 1))
+			++prev;
+		/* Mail gets a new line either way. */
+		if (prev)
+			prev->keep = 0;
+
+		char path[PATH_MAX];
+		int dirfd;
+		if (!prev || !strcmp(prev->name, m->name) ||
+		    (dirfd = maildir_find(md, prev->name, path, sizeof path)) < 0)
+		{
+			mails_keep(mails, &n, m);
+			continue;
+		}
+
+		maildir_replace(md, dirfd, path, m);
+		mails_drop(m);
+	}
+
+	size_t nreplaced = *nmails - n;
+	*nmails = n;
+	return nreplaced;
+}
+
+/* Deliver mails into folder. Linked and replaced mails are removed. */
+static void
+maildir_flush(char const *folder, struct outbox_mail *mails, size_t *nmails)
+{
+	struct maildir const *md = maildir_open(folder);
+	/* Handled mails are kept behind the first *nmails. */
+	size_t nall = *nmails;
+	struct mails_log log = { 0 };
+	feed_track(mails_log_release, &log);
+	/* Imported snapshots mix feeds. */
+	size_t nreplaced = *stats.id
+		? maildir_replace_previous(md, folder, &log, mails, nmails)
+		: 0;
+	size_t nlinked = opt_dedup ? dedup_link(md, mails, nmails) : 0;
+#ifdef HAVE_IO_URING
+	if (!maildir_deliver_uring(md, mails, *nmails))
+#endif
+	for (size_t i = 0; i < *nmails; ++i)
+		maildir_deliver(md, &mails[i]);
+
+	if (DURABILITY_STRICT <= opt_durability) {
+		xfsyncdirat(md->new, ".");
+		xfsyncdirat(md->cur, ".");
+	}
+
+	/*
+	 * Only once mails exist, including replaced ones and the ones linked from
+	 * the store. Superseded lines are dropped so log does not grow with every
+	 * update.
+	 */
+	if (*stats.id) {
+		size_t nstale = 0;
+		for (size_t i = 0; i < log.n; ++i)
+			nstale += !log.items[i].keep;
+		if (nstale)
+			mails_log_rewrite(&log, folder, mails, nall);
+		else
+			mails_log_append(folder, mails, nall);
+	}
+	feed_untrack(&log);
+	mails_log_release(&log);
+
+	if (opt_dedup)
+		dedup_store(md, mails, *nmails);
+
+	if (nlinked)
+		msg(LOG_INFO, "Linked %zu mails from store", nlinked);
+	stats.mails_linked += nlinked;
+	if (nreplaced)
+		msg(LOG_INFO, "Replaced %zu previous versions", nreplaced);
+	stats.mails_replaced += nreplaced;
+}
+
+static char const *
+outbox_mail_folder(struct outbox_mail const *m)
+{
+	return m->folder ? m->folder : opt_folder;
+}
+
+static int
+outbox_mail_cmp_folder(void const *a, void const *b)
+{
+	return strcmp(outbox_mail_folder(a), outbox_mail_folder(b));
+}
+
+/* Remove mails of feed past its retention limit, except flagged ones. */
+static void
+mails_prune(void)
+{
+	if (opt_dry_run || *opt_lmtp || (!opt_prune_age && !opt_prune_count))
+		return;
+
+	char logname[PATH_MAX];
+	mails_log_name(logname, sizeof logname);
+
+	struct mails_log log = { 0 };
+	feed_track(mails_log_release, &log);
+	if (!mails_log_read(&log, logname)) {
+		feed_untrack(&log);
+		return;
+	}
+
+	/* Regenerated root mails and replaced entries left stale lines. */
+	size_t nlive = mails_log_supersede(&log);
+	if (log.n)
+		qsort(log.items, log.n, sizeof *log.items, logged_mail_cmp_seq);
+
+	size_t nexcess = opt_prune_count && (size_t)opt_prune_count < nlive
+		? nlive - opt_prune_count
+		: 0;
+	long long oldest = opt_prune_age ? (long long)time(NULL) - opt_prune_age : 0;
+	size_t nremoved = 0;
+	size_t nchanged = log.n - nlive;
+	for (size_t i = 0, ilive = 0; i < log.n; ++i) {
+		struct logged_mail *m = &log.items[i];
+		if (!m->keep)
+			continue;
+		if (!(ilive++ < nexcess || m->date < oldest))
+			continue;
+
+		int rc = maildir_prune(maildir_open(m->folder), m->name);
+		if (rc < 0)
+			continue;
+		m->keep = 0;
+		nremoved += rc;
+		++nchanged;
+	}
+
+	if (nchanged)
+		mails_log_rewrite(&log, NULL, NULL, 0);
+
+	feed_untrack(&log);
+	mails_log_release(&log);
+
+	if (nremoved)
+		msg(LOG_INFO, "Pruned %zu mails", nremoved);
+	stats.mails_pruned += nremoved;
+}
+
+static void
+outbox_flush(void)
+{
+	if (!outbox_size) {
+		/* Entries may have been dropped by filters. */
+		entry_index_write();
+		return;
+	}
+
+	outbox_render();
+	if (digest.mail.stream)
+		outbox_digest();
+
+	stats.mails += outbox_size;
+	size_t nmails = outbox_size;
+	if (*opt_lmtp) {
+		size_t nretry = lmtp_deliver(opt_lmtp,
+				*opt_lmtp_recipient
+					? opt_lmtp_recipient
+					: getenv("USER"),
+				outbox, outbox_size);
+		if (nretry) {
+			/* Accepted ones are not sent again. */
+			if (nretry < outbox_size) {
+				for (size_t i = 0; i < nretry; ++i)
+					entry_index_remove(outbox[i].name);
+				entry_index_write();
+			}
+			msg(LOG_ERR, "LMTP: %zu of %zu mails temporarily failed",
+					nretry, outbox_size);
+		}
+	} else {
+		/* Filters may route mails into other folders. */
+		qsort(outbox, outbox_size, sizeof *outbox, outbox_mail_cmp_folder);
+		for (size_t i = 0, j; i < outbox_size; i = j) {
+			char const *folder = outbox_mail_folder(&outbox[i]);
+			for (j = i + 1; j < outbox_size &&
+			                !strcmp(folder, outbox_mail_folder(&outbox[j])); ++j)
+				;
+			size_t n = j - i;
+			maildir_flush(folder, &outbox[i], &n);
+		}
+
+		size_t n = 0;
+		for (size_t i = 0; i < outbox_size; ++i)
+			if (outbox[i].data)
+				outbox[n++] = outbox[i];
+		outbox_size = n;
+	}
+
+	msg(LOG_INFO, "Delivered %zu mails", nmails);
+
+	entry_index_write();
+	outbox_clear();
+}
+
+static enum rfc822_type
+rfc822_classify(unsigned char const *s)
+{
+	enum rfc822_type ret = RFC822_ATOM;
+	for (; *s; ++s) {
+		enum rfc822_type t;
+		if (' ' < *s && *s <= '~')
+			t = RFC822_ATOM;
+		else if (*s <= '~' && !('\r' == s[0] && '\n' == s[1])) {
+			t = RFC822_TEXT;
+		} else
+			t = RFC822_NONASCII;
+
+		if (ret < t)
+			ret = t;
+	}
+	return ret;
+}
+
+/* "Q"-encoding. */
+static void
+rfc2047_write_qenc(unsigned char const *s, FILE *stream)
+{
+	static char const HEX[16] = "0123456789ABCDEF";
+
+	fwrite("=?UTF-8?Q?", 1, 10, stream);
+	for (; *s; ++s) {
+		if (' ' == *s) {
+			fputc('_', stream);
+		} else if (('0' <= *s && *s <= '9') ||
+		           ('a' <= *s && *s <= 'z') ||
+		           ('A' <= *s && *s <= 'Z') ||
+		           '+' == *s || '-' == *s)
+		{
+			fputc(*s, stream);
+		} else {
+			fputc('=', stream);
+			fputc(HEX[*s >> 4], stream);
+			fputc(HEX[*s & 0xf], stream);
+		}
+	}
+	fwrite("?=", 1, 2, stream);
+}
+
+static void
+rfc822_write_quoted(unsigned char const *s, FILE *stream)
+{
+	fputc('"', stream);
+	for (; *s; ++s) {
+		if ('"' == *s || '\\' == *s || '\r' == *s)
+			fputc('\\', stream);
+		fputc(*s, stream);
+	}
+	fputc('"', stream);
+}
+
+/*
+ * Format specifiers:
+ * %s: Unrestricted NUL terminated string.
+ * %t: Text.
+ * %w: Word.
+ */
+static void
+mail_write_hdr(struct mail *mail, char const *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	for (char const *s = fmt; (s = strchr(s, '%'));) {
+		s += 2; /* %X */
+		unsigned char const *arg = va_arg(ap, unsigned char *);
+		if (!arg) {
+			va_end(ap);
+			return;
+		}
+	}
+	va_end(ap);
+
+	va_start(ap, fmt);
+	for (char const *s = fmt;;) {
+		char const *from = s;
+		s = strchr(from, '%');
+		if (!s)
+			s = from + strlen(from);
+
+		size_t len = (size_t)(s - from);
+		fwrite(from, 1, len, mail->stream);
+		if (!*s)
+			break;
+
+		enum rfc822_type allow;
+		switch (s[1]) {
+		case 's': allow = RFC822_NONASCII; break;
+		case 't': allow = RFC822_TEXT; break;
+		case 'w': allow = RFC822_ATOM; break;
+		default: abort();
+		}
+
+		char const *arg = va_arg(ap, char *);
+		enum rfc822_type type = rfc822_classify((unsigned char *)arg);
+
+		if (type <= allow) {
+			fputs(arg, mail->stream);
+		} else switch (type) {
+		case RFC822_TEXT:
+			rfc822_write_quoted((unsigned char *)arg, mail->stream);
+			break;
+
+		case RFC822_NONASCII:
+			rfc2047_write_qenc((unsigned char *)arg, mail->stream);
+			break;
+
+		default:
+			abort();
+		}
+
+		s += 2; /* %s */
+	}
+	va_end(ap);
+
+	fputc('\n', mail->stream);
+}
+
+static char *
+get_domain(char **url)
+{
+	if (!*url) {
+		*url = (char *)"localhost";
+		return NULL;
+	}
+
+	char *slash = NULL;
+	char *s = strstr(*url, "://");
+	if (s) {
+		*url = s + 3;
+		slash = strchr(*url, '/');
+		if (slash)
+			*slash = '\0';
+	}
+	return slash;
+}
+
+static void
+mail_write_from_hdr(struct mail *mail, struct entry const *feed)
+{
+	char *phrase = NULL;
+	char *addr_spec = NULL;
+
+	if (*opt_from)
+		phrase = opt_from;
+	else
+		phrase = (char *)feed->subject;
+	addr_spec = (char *)feed->link;
+
+	char *slash = get_domain(&addr_spec);
+	if (phrase)
+		mail_write_hdr(mail, "From: %w <feed@%s>", phrase, addr_spec);
+	else
+		mail_write_hdr(mail, "From: feed@%s", addr_spec);
+	if (slash)
+		*slash = '/';
+}
+
+static void
+mail_write_feed_msgid_hdr(struct mail *mail, char const *name, struct entry const *feed)
+{
+	HASH id;
+	hash_entry(id, feed, 1);
+
+	char *s = (char *)feed->link;
+	char *slash = get_domain(&s);
+	mail_write_hdr(mail, "%s: <%s@%s>", name, id, s);
+	if (slash)
+		*slash = '/';
+}
+
+static void
+mail_write_author_hdr(struct mail *mail, struct entry const *e)
+{
+	for (size_t i = 0; i < e->authors.n; ++i) {
+		xmlChar const *name = e->authors.items[i];
+		if (e->feed && strset_has(&e->feed->authors, name))
+			continue;
+
+		if (e->emails[i])
+			mail_write_hdr(mail, "Author: %t <%t>",
+					name, e->emails[i]);
+		else
+			mail_write_hdr(mail, "Author: %t", name);
+	}
+}
+
+static void
+mail_write_category_hdr(struct mail *mail, struct entry const *e)
+{
+	for (size_t i = 0; i < e->categories.n; ++i) {
+		xmlChar const *name = e->categories.items[i];
+		if (e->feed && strset_has(&e->feed->categories, name))
+			continue;
+
+		mail_write_hdr(mail, "X-Category: %t", name);
+	}
+}
+
+/* Write content, cut at a character boundary if it is too large. */
+static void
+write_body(FILE *stream, struct entry const *entry)
+{
+	char const *content = (char const *)entry->text.content;
+	size_t size = strlen(content);
+	if (!opt_max_entry_size || size <= (size_t)opt_max_entry_size) {
+		fprintf(stream, "\n%s", content);
+		return;
+	}
+
+	size_t n = opt_max_entry_size;
+	while (n && 0x80 == (content[n] & 0xc0))
+		--n;
+	fprintf(stream,
+			!strncmp(entry->text.mime_type, "text/html", 9)
+				? "\n%.*s\n<p>[Truncated by mrss: %zu of %zu bytes]</p>\n"
+				: "\n%.*s\n\n[Truncated by mrss: %zu of %zu bytes]\n",
+			(int)n, content, n, size);
+	++stats.entries_truncated;
+}
+
+static void
+html_write_attr(FILE *stream, char const *s)
+{
+	for (; *s; ++s)
+		if ('&' == *s)
+			fputs("&amp;", stream);
+		else if ('"' == *s)
+			fputs("&quot;", stream);
+		else
+			fputc(*s, stream);
+}
+
+/* Body of entry with image enclosures shown after the content. */
+static char *
+entry_html(struct entry const *entry)
+{
+	char *html;
+	size_t size;
+	FILE *stream = open_memstream(&html, &size);
+	if (!stream)
+		msg(LOG_ERR, "Cannot create mail: %s", strerror(errno));
+
+	if (entry->text.content)
+		write_body(stream, entry);
+	else
+		fputc('\n', stream);
+
+	for (size_t i = 0; i < entry->images.n; ++i) {
+		fputs("\n<p><img src=\"", stream);
+		html_write_attr(stream, (char const *)entry->images.items[i]);
+		fputs("\"></p>", stream);
+	}
+
+	if (fclose(stream)) {
+		free(html);
+		msg(LOG_ERR, "Cannot create mail: %s", strerror(errno));
+	}
+	return html;
+}
+
+static int
+entry_index_has(char const *name)
+{
+	return entry_index.nold &&
+	       bsearch(name, entry_index.old, entry_index.nold,
+	               sizeof *entry_index.old, hash_cmp);
+}
+
+static void
+entry_index_add(char const *name)
+{
+	if (!*entry_index.path)
+		return;
+
+	if (entry_index.alloc <= entry_index.nnames) {
+		size_t n = entry_index.alloc ? 2 * entry_index.alloc : 16;
+		HASH *p = realloc(entry_index.names, n * sizeof *p);
+		if (!p)
+			msg(LOG_ERR, "Cannot allocate memory");
+		entry_index.names = p;
+		entry_index.alloc = n;
+	}
+	strcpy(entry_index.names[entry_index.nnames++], name);
+	if (!entry_index_has(name))
+		entry_index.changed = 1;
+}
+
+/* Digest takes the place of the root mail. */
+static void
+digest_begin(struct entry const *feed)
+{
+	if (digest.mail.stream)
+		return;
+
+	mail_create(&digest.mail);
+	/* Released by outbox_clear(). */
+	feed_untrack(&digest.mail);
+
+	char datetime[50];
+	time_t now = time(NULL);
+	strftime(datetime, sizeof datetime, RFC_822, localtime(&now));
+	mail_write_hdr(&digest.mail, "Received: mrss; %s", datetime);
+	mail_write_hdr(&digest.mail, "Date: %s", datetime);
+	mail_write_from_hdr(&digest.mail, feed);
+	mail_write_hdr(&digest.mail, "Subject: %t", feed->subject);
+	mail_write_hdr(&digest.mail, "Link: %t", feed->link);
+}
+
+/* Into the folder of the entry, so that it is threaded under it. */
+static void
+generate_root_mail(struct entry const *feed, char const *folder)
+{
+	if (!opt_reply_to)
+		return;
+
+	struct mail mail;
+	mail_create(&mail);
+	mail.folder = folder;
+
+	mail_write_feed_msgid_hdr(&mail, "Message-ID", feed);
+	mail_write_from_hdr(&mail, feed);
+	mail_write_hdr(&mail, "Subject: %t", feed->subject);
+	mail_write_hdr(&mail, "Link: %t", feed->link);
+	if (feed->text.content) {
+		mail_write_hdr(&mail, "Content-Type: %s", feed->text.mime_type);
+		write_body(mail.stream, feed);
+	}
+
+	HASH id;
+	hash_entry(id, feed, 1);
+	mail_commit(&mail, id, id, "", 0);
+}
+
+static size_t
+header_cb(char *buf, size_t size, size_t nmemb, void *userdata)
+{
+	(void)userdata;
+
+	size *= nmemb;
+
+	if (curl_strnequal(buf, "etag:", 5)) {
+		size_t n = size - 5 - 2 /* CRLF */;
+		if (n <= sizeof new_state.etag - 1 /* NUL */) {
+			memcpy(new_state.etag, buf + 5, n);
+			new_state.etag[n] = '\0';
+		} else {
+			msg(LOG_WARNING, "Response ETag is ignored because too long");
+		}
+	} else if (curl_strnequal(buf, "expires:", 8)) {
+		new_state.expiration = parse_date(buf + 8);
+	} else if (curl_strnequal(buf, "last-modified:", 14)) {
+		new_state.last_modified = parse_date(buf + 14);
+	} else {
+		return size;
+	}
+
+	if (rec.headers)
+		fwrite(buf, 1, size, rec.headers);
+
+	return size;
+}
+
+/* Return whether XML is still valid. */
+static int
+xml_push(xmlParserCtxtPtr *xml, char const *buf, size_t size)
+{
+	if (!*xml) {
+		*xml = xmlCreatePushParserCtxt(NULL, NULL, buf, size, NULL);
+		/* XXX: Should ensure that we have enough bytes to kickstart. */
+		return !!*xml;
+	}
+	return !xmlParseChunk(*xml, buf, size, 0 /* Terminate? */);
+}
+
+static int
+response_fits(long long size)
+{
+	return !opt_max_response_size || size <= opt_max_response_size;
+}
+
+static size_t
+write_xml(char *buf, size_t size, size_t nmemb, void *userdata)
+{
+	xmlParserCtxtPtr *xml = userdata;
+
+	size *= nmemb;
+
+	if (!response_fits(stats.bytes + size)) {
+		stats.oversized = 1;
+		xml_invalid = 1;
+		return 0;
+	}
+
+	if (rec.body) {
+		fwrite(buf, 1, size, rec.body);
+		sha1_update(&rec.body_sha1, (BYTE const *)buf, size);
+	}
+
+	stats.bytes += size;
+
+	TRACE_BEGIN("write_xml");
+	long long start = clock_us();
+	xml_invalid = !xml_push(xml, buf, size);
+	stats.parse += clock_us() - start;
+	TRACE_END();
+
+	/* Abort transfer. Do not longjmp() through cURL. */
+	return xml_invalid ? 0 : size;
+}
+
+void
+entry_process(struct entry const *entry)
+{
+	TRACE_BEGIN("entry_process");
+
+	struct entry const *feed = entry->feed;
+	msg(LOG_INFO, "Received entry [%s] '%s'", entry->date, entry->subject);
+	++stats.entries_seen;
+
+	time_t date = 0;
+	if (entry->date) {
+		date = parse_date((char *)entry->date);
+
+		if (date <= old_state.last_modified) {
+			TRACE_END();
+			return;
+		}
+	}
+
+	HASH name;
+	hash_entry(name, entry, 1);
+	if (entry_index_has(name)) {
+		msg(LOG_INFO, "Already handled");
+		entry_index_add(name);
+		TRACE_END();
+		return;
+	}
+
+	char const *folder = NULL;
+	if (filter_match(entry, &folder) && !folder) {
+		msg(LOG_INFO, "Filtered");
+		++stats.entries_filtered;
+		/* So it is not matched again. */
+		entry_index_add(name);
+		if (new_state.last_modified < date)
+			new_state.last_modified = date;
+		TRACE_END();
+		return;
+	}
+
+	/* Not recorded, so they come again with the next run. */
+	if (opt_max_entries && (size_t)opt_max_entries <= stats.entries_new) {
+		msg(LOG_INFO, "Dropped");
+		++stats.entries_dropped;
+		if (date && (!dropped_since || date < dropped_since))
+			dropped_since = date;
+		TRACE_END();
+		return;
+	}
+
+	if (new_state.last_modified < date)
+		new_state.last_modified = date;
+
+	msg(LOG_INFO, "New");
+	++stats.entries_new;
+
+	if (opt_digest)
+		digest_begin(feed);
+	else
+		generate_root_mail(feed, folder);
+
+	struct mail mail;
+	mail_create(&mail);
+	mail.folder = folder;
+
+	char datetime[50];
+	time_t now = time(NULL);
+	strftime(datetime, sizeof datetime, RFC_822, localtime(&now));
+	mail_write_hdr(&mail, "Received: mrss; %s", datetime);
+
+	HASH id;
+	hash_entry(id, entry, 0);
+	mail_write_hdr(&mail, "Message-ID: <%s@localhost>", id);
+	mail_write_feed_msgid_hdr(&mail, "In-Reply-To", feed);
+	mail_write_hdr(&mail, "Content-Language: %t", entry->lang);
+	mail_write_hdr(&mail, "Content-Transfer-Encoding: binary");
+
+	if (date) {
+		strftime(datetime, sizeof datetime, RFC_822, localtime(&date));
+		mail_write_hdr(&mail, "Date: %s", datetime);
+	}
+
+	mail_write_from_hdr(&mail, feed);
+	mail_write_hdr(&mail, "Subject: %t", entry->subject);
+	mail_write_category_hdr(&mail, feed);
+	mail_write_category_hdr(&mail, entry);
+	mail_write_author_hdr(&mail, feed);
+	mail_write_author_hdr(&mail, entry);
+	mail_write_hdr(&mail, "Link: %t", entry->link);
+	if (opt_inline_images &&
+	    (entry->text.content
+	     ? !strncmp(entry->text.mime_type, "text/html", 9)
+	     : entry->images.n))
+	{
+		mail.html = entry_html(entry);
+	} else if (entry->text.content) {
+		mail_write_hdr(&mail, "Content-Type: %s", entry->text.mime_type);
+		write_body(mail.stream, entry);
+	}
+
+	HASH content = "";
+	if (opt_dedup)
+		hash_entry_content(content, entry);
+	mail_commit(&mail, id, name, content, 1);
+	entry_index_add(name);
+
+	TRACE_END();
+}
+
+static void
+cassette_open(int *dirfd, char const *path, int create)
+{
+	if (0 <= *dirfd)
+		close(*dirfd);
+	*dirfd = -1;
+
+	if (!*path)
+		return;
+
+	if (create)
+		*dirfd = xopendirat(AT_FDCWD, path);
+	else if ((*dirfd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+		msg(LOG_ERR, "Cannot open '%s': %s", path, strerror(errno));
+}
+
+static void
+record_abort(void)
+{
+	feed_untrack(&rec);
+	if (rec.body) {
+		fclose(rec.body);
+		rec.body = NULL;
+	}
+	/* Also if closing it failed in record_end(). */
+	if (*rec.body_tmpname) {
+		(void)unlinkat(record_dirfd, rec.body_tmpname, 0);
+		*rec.body_tmpname = '\0';
+	}
+	if (rec.headers) {
+		fclose(rec.headers);
+		free(rec.headers_buf);
+		rec.headers = NULL;
+	}
+}
+
+static void
+record_release(void *p)
+{
+	(void)p;
+	record_abort();
+}
+
+/* Start capturing response of url. */
+static void
+record_begin(char const *url)
+{
+	/* Left over if previous response failed mid-transfer. */
+	record_abort();
+
+	if (record_dirfd < 0)
+		return;
+
+	hash_str(rec.name, url);
+	strcpy(rec.body_tmpname, "body.XXXXXX");
+	rec.body = xftmpopenat(record_dirfd, rec.body_tmpname);
+	sha1_init(&rec.body_sha1);
+	feed_track(record_release, &rec);
+	rec.headers = open_memstream(&rec.headers_buf, &rec.headers_size);
+	if (!rec.headers)
+		msg(LOG_ERR, "Cannot allocate memory");
+}
+
+/*
+ * Store captured response. Body is stored under its hash, response of a URL
+ * is described by a file named by the URL hash:
+ *
+ * - status code (0 for non-HTTP), or "error: " followed by the message,
+ * - body hash, empty if there was no body,
+ * - relevant header lines.
+ */
+static void
+record_end(long status, char const *error)
+{
+	if (!rec.body)
+		return;
+
+	HASH body_name = "";
+	if (!error && 0 < ftell(rec.body)) {
+		BYTE bytes[SHA1_BLOCK_SIZE];
+		sha1_final(&rec.body_sha1, bytes);
+		hash_from_sha1(body_name, bytes);
+	}
+
+	FILE *body = rec.body;
+	rec.body = NULL;
+	xfclose(body, rec.body_tmpname);
+	if (*body_name) {
+		xrenameat(record_dirfd, rec.body_tmpname, record_dirfd, body_name);
+		*rec.body_tmpname = '\0';
+	}
+
+	struct tmpfile t;
+	FILE *f = tmpfile_open(&t, record_dirfd, "index.XXXXXX");
+	if (error) {
+		fprintf(f, "error: %s\n", error);
+	} else {
+		fflush(rec.headers);
+		fprintf(f, "%ld\n%s\n", status, body_name);
+		for (char const *s = rec.headers_buf; *s;) {
+			size_t n = strcspn(s, "\r\n");
+			fprintf(f, "%.*s\n", (int)n, s);
+			s += n;
+			s += strspn(s, "\r\n");
+		}
+	}
+	tmpfile_commit(&t, record_dirfd, rec.name, 0);
+
+	record_abort();
+}
+
+static FILE *
+xfopenat(int dirfd, char const *path)
+{
+	int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	FILE *f = 0 <= fd ? fdopen(fd, "r") : NULL;
+	if (!f)
+		msg(LOG_ERR, "Cannot open '%s': %s", path, strerror(errno));
+	return f;
+}
+
+/* Report parse error of write_xml(). */
+static void
+check_xml(void)
+{
+	if (stats.oversized) {
+		record_end(0, "Response too large");
+		msg(LOG_ERR, "Response is larger than %d bytes", opt_max_response_size);
+	}
+
+	if (!xml_invalid)
+		return;
+
+	record_end(0, "Invalid XML");
+	stats.phase = FEED_PHASE_PARSE;
+	msg(LOG_ERR, "Invalid XML");
+}
+
+/* Serve response of url from the cassette like it would come from network. */
+static int
+open_feed_replay(xmlParserCtxtPtr *xml, char const *url)
+{
+	HASH id;
+	hash_str(id, url);
+
+	if (faccessat(replay_dirfd, id, F_OK, 0) && ENOENT == errno)
+		msg(LOG_ERR, "Response is not recorded");
+
+	char buf[BUFSIZ];
+	FILE *f = xfopenat(replay_dirfd, id);
+	if (!xfgets(buf, sizeof buf, f)) {
+		fclose(f);
+		msg(LOG_ERR, "Invalid cassette entry: '%s'", id);
+	}
+
+	if (!strncmp(buf, "error: ", 7)) {
+		fclose(f);
+		record_end(0, buf + 7);
+		msg(LOG_ERR, "%s", buf + 7);
+	}
+
+	long status = atol(buf);
+
+	HASH body_name = "";
+	if (xfgets(buf, sizeof buf, f) && *buf) {
+		if (sizeof body_name <= strlen(buf)) {
+			fclose(f);
+			msg(LOG_ERR, "Invalid cassette entry: '%s'", id);
+		}
+		strcpy(body_name, buf);
+	}
+
+	while (xfgets(buf, sizeof buf - 2 /* CRLF */, f)) {
+		strcat(buf, "\r\n");
+		header_cb(buf, 1, strlen(buf), xml);
+	}
+	fclose(f);
+
+	if (*body_name) {
+		FILE *body = xfopenat(replay_dirfd, body_name);
+		for (size_t n; (n = fread(buf, 1, sizeof buf, body));)
+			if (n != write_xml(buf, 1, n, xml))
+				break;
+		fclose(body);
+		check_xml();
+	}
+
+	record_end(status, NULL);
+
+	return !status || 200 == status;
+}
+
+static char const *
+curl_error(CURLcode rc)
+{
+	return *curl_error_buf
+		? curl_error_buf
+		: curl_easy_strerror(rc);
+}
+
+/* Times are measured from the start of the request. */
+static void
+curl_stats(void)
+{
+	long status;
+	if (CURLE_OK == curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status))
+		stats.status = status;
+
+	static struct {
+		CURLINFO info;
+		long long *value;
+	} const INFOS[] = {
+		{ CURLINFO_NAMELOOKUP_TIME_T, &stats.dns },
+		{ CURLINFO_CONNECT_TIME_T, &stats.connect },
+		{ CURLINFO_APPCONNECT_TIME_T, &stats.tls },
+		{ CURLINFO_STARTTRANSFER_TIME_T, &stats.first_byte },
+		{ CURLINFO_TOTAL_TIME_T, &stats.fetch },
+		{ CURLINFO_SIZE_DOWNLOAD_T, &stats.bytes },
+	};
+	for (size_t i = 0; i < sizeof INFOS / sizeof *INFOS; ++i) {
+		curl_off_t value;
+		if (CURLE_OK == curl_easy_getinfo(curl, INFOS[i].info, &value))
+			*INFOS[i].value = value;
+	}
+}
+
+static void
+check_curl(CURLcode rc)
+{
+	if (rc == CURLE_OK)
+		return;
+
+	msg(LOG_ERR, "cURL error: %s", curl_error(rc));
+}
+
+static void
+headers_release(void *p)
+{
+	struct curl_slist **headers = p;
+	curl_slist_free_all(*headers);
+}
+
+static int
+open_feed_curl(xmlParserCtxtPtr *xml, char const *url)
+{
+	TRACE_BEGIN("open_feed_curl");
+
+	if (!curl)
+		curl = curl_easy_init();
+	if (!curl)
+		msg(LOG_ERR, "cURL error: cannot initialize");
+
+	struct curl_slist *headers = NULL;
+	feed_track(headers_release, &headers);
+	char buf[50 + 1024];
+
+	if (*old_state.etag) {
+		sprintf(buf, "If-None-Match:%s", old_state.etag);
+		headers = curl_slist_append(headers, buf);
+	} else if (old_state.last_modified) {
+		char datetime[50];
+		strftime(datetime, sizeof datetime, RFC_2616,
+				gmtime(&old_state.last_modified));
+		sprintf(buf, "If-Modified-Since: %s", datetime);
+		headers = curl_slist_append(headers, buf);
+	}
+
+	curl_easy_reset(curl);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error_buf);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L);
+	curl_easy_setopt(curl, CURLOPT_AUTOREFERER, 1L);
+	curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)opt_verbose);
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	check_curl(curl_easy_setopt(curl, CURLOPT_PROXY, opt_proxy));
+	check_curl(curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L));
+	check_curl(curl_easy_setopt(curl, CURLOPT_SOCKS5_AUTH, CURLAUTH_BASIC));
+	check_curl(curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb));
+	check_curl(curl_easy_setopt(curl, CURLOPT_HEADERDATA, xml));
+	check_curl(curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_xml));
+	check_curl(curl_easy_setopt(curl, CURLOPT_WRITEDATA, xml));
+	check_curl(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers));
+	check_curl(curl_easy_setopt(curl, CURLOPT_USERAGENT,
+			*opt_user_agent ? opt_user_agent : NULL));
+	check_curl(curl_easy_setopt(curl, CURLOPT_URL, url));
+	/* Fail early when announced by Content-Length. */
+	check_curl(curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE,
+			(curl_off_t)opt_max_response_size));
+
+	CURLcode rc = curl_easy_perform(curl);
+
+	feed_untrack(&headers);
+	curl_slist_free_all(headers);
+	curl_stats();
+
+	long status_code = 0;
+	if (CURLE_OK == rc)
+		rc = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
+	else if (CURLE_FILESIZE_EXCEEDED == rc)
+		stats.oversized = 1;
+
+	check_xml();
+	if (CURLE_OK != rc) {
+		char error[CURL_ERROR_SIZE + 32];
+		snprintf(error, sizeof error, "cURL error: %s", curl_error(rc));
+		record_end(0, error);
+	} else {
+		record_end(status_code, NULL);
+	}
+	check_curl(rc);
+
+	TRACE_END();
+
+	/* Non-HTTP requests return 0. */
+	return !status_code || 200 == status_code;
+}
+
+static struct spawn_limits
+program_limits(void)
+{
+	return (struct spawn_limits){
+		.timeout = opt_command_timeout,
+		.cpu = opt_command_cpu,
+		.memory = (long long)opt_command_memory << 20,
+	};
+}
+
+static int
+program_write(struct spawn_cmd *cmd, char const *buf, size_t size)
+{
+	struct program *p = cmd->data;
+	return size == write_xml((char *)buf, 1, size, p->xml);
+}
+
+/* Collect lines to be applied when the feed is processed. */
+static void
+program_line(struct spawn_cmd *cmd, char const *line)
+{
+	struct program *p = cmd->data;
+	size_t n = strlen(line);
+	if (sizeof p->headers - p->nheaders <= n + 2) {
+		msg(LOG_WARNING, "Command header is ignored because too long");
+		return;
+	}
+	memcpy(p->headers + p->nheaders, line, n);
+	memcpy(p->headers + p->nheaders + n, "\r\n", 2);
+	p->nheaders += n + 2;
+}
+
+static void
+program_exited(struct spawn_cmd *cmd, int status)
+{
+	struct program *p = cmd->data;
+	p->status = status;
+}
+
+/* Expose stored state to the command so it can skip unchanged content. */
+static void
+program_env(struct program *p)
+{
+	size_t size;
+	FILE *stream = open_memstream(&p->env_vars, &size);
+	if (!stream)
+		msg(LOG_ERR, "Cannot allocate memory");
+
+	HASH id;
+	hash_str(id, p->url);
+	fprintf(stream, "MRSS_URL=%s%c", p->url, '\0');
+	fprintf(stream, "MRSS_ID=%s%c", id, '\0');
+	if (*old_state.etag)
+		fprintf(stream, "MRSS_ETAG=%s%c",
+				old_state.etag + strspn(old_state.etag, " \t"), '\0');
+
+	char datetime[50];
+	if (old_state.last_modified) {
+		strftime(datetime, sizeof datetime, RFC_2616,
+				gmtime(&old_state.last_modified));
+		fprintf(stream, "MRSS_LAST_MODIFIED=%s%c", datetime, '\0');
+	}
+	if (old_state.expiration) {
+		strftime(datetime, sizeof datetime, RFC_2616,
+				gmtime(&old_state.expiration));
+		fprintf(stream, "MRSS_EXPIRES=%s%c", datetime, '\0');
+	}
+	xfclose(stream, "environment");
+
+	size_t n = 0;
+	while (environ[n])
+		++n;
+	char **env = malloc((n + 6) * sizeof *env);
+	if (!env)
+		msg(LOG_ERR, "Cannot allocate memory");
+	p->env = env;
+
+	for (char *s = p->env_vars; s < p->env_vars + size; s += strlen(s) + 1)
+		*env++ = s;
+	for (char **s = environ; *s; ++s)
+		if (strncmp(*s, "MRSS_", 5))
+			*env++ = *s;
+	*env = NULL;
+}
+
+static void
+program_release(void *data)
+{
+	struct program *p = data;
+	free(p->env);
+	p->env = NULL;
+	free(p->env_vars);
+	p->env_vars = NULL;
+}
+
+static int
+open_feed_program(xmlParserCtxtPtr *xml, char const *command)
+{
+	struct program *p = program_finished, program;
+	if (p) {
+		/* Output has been parsed while the command was running. */
+		*xml = p->ctxt;
+		p->ctxt = NULL;
+		stats.bytes = p->bytes;
+		stats.parse = p->parse;
+		xml_invalid = p->invalid;
+		stats.oversized = p->oversized;
+	} else {
+		static struct spawn_handler const HANDLER = {
+			.output = program_write,
+			.line = program_line,
+			.done = program_exited,
+		};
+		p = &program;
+		*p = (struct program){ .url = stats.url, .xml = xml };
+		feed_track(program_release, p);
+		program_env(p);
+
+		struct spawn_cmd cmd = {
+			.command = command,
+			.envp = p->env,
+			.data = p,
+		};
+		struct spawn_limits limits = program_limits();
+		spawn_run(&cmd, 1, 1, &limits, &HANDLER);
+
+		feed_untrack(p);
+		program_release(p);
+	}
+
+	for (char *s = p->headers, *end = s + p->nheaders; s < end;) {
+		size_t n = strstr(s, "\r\n") + 2 - s;
+		header_cb(s, 1, n, NULL);
+		s += n;
+	}
+
+	check_xml();
+	if (WIFEXITED(p->status) && EXIT_SUCCESS == WEXITSTATUS(p->status)) {
+		/* No XML == not changed. */
+		if (!*xml) {
+			record_end(304, NULL);
+			return 0;
+		}
+		record_end(0, NULL);
+		return 1;
+	}
+
+	record_end(0, "Process terminated with failure");
+	msg(LOG_ERR, "Process terminated with failure");
+	abort();
+}
+
+/*
+ * Local files are mapped and parsed in one go. File identity and
+ * modification time stand in for ETag so an unchanged file is not read. Both
+ * are taken from the opened file so they describe what is mapped.
+ */
+static int
+open_feed_file(xmlDocPtr *doc, char const *path)
+{
+	TRACE_BEGIN("open_feed_file");
+
+	char buf[128];
+	struct stat st;
+	int fd = -1;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st)) {
+		int err = errno;
+		if (0 <= fd)
+			close(fd);
+		snprintf(buf, sizeof buf, "Cannot open file: %s", strerror(err));
+		record_end(0, buf);
+		msg(LOG_ERR, "Cannot open '%s': %s", path, strerror(err));
+	}
+
+	/* Same as HTTP headers so they are recorded and replayed alike. */
+	snprintf(buf, sizeof buf, "ETag: \"%llx-%llx-%llx.%09ld\"\r\n",
+			(unsigned long long)st.st_ino,
+			(unsigned long long)st.st_size,
+			(unsigned long long)st.st_mtim.tv_sec,
+			st.st_mtim.tv_nsec);
+	header_cb(buf, 1, strlen(buf), NULL);
+	char datetime[50];
+	strftime(datetime, sizeof datetime, RFC_2616, gmtime(&st.st_mtime));
+	snprintf(buf, sizeof buf, "Last-Modified: %s\r\n", datetime);
+	header_cb(buf, 1, strlen(buf), NULL);
+
+	if (!strcmp(new_state.etag, old_state.etag)) {
+		close(fd);
+		record_end(304, NULL);
+		TRACE_END();
+		return 0;
+	}
+
+	if (!response_fits(st.st_size)) {
+		close(fd);
+		stats.oversized = 1;
+		check_xml();
+	}
+
+	if (!st.st_size || INT_MAX < st.st_size) {
+		close(fd);
+		record_end(0, "Invalid XML");
+		stats.phase = FEED_PHASE_PARSE;
+		msg(LOG_ERR, "Invalid XML");
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == data)
+		msg(LOG_ERR, "Cannot map '%s': %s", path, strerror(errno));
+
+	if (rec.body) {
+		fwrite(data, 1, st.st_size, rec.body);
+		sha1_update(&rec.body_sha1, data, st.st_size);
+	}
+	stats.bytes = st.st_size;
+
+	stats.phase = FEED_PHASE_PARSE;
+	long long start = clock_us();
+	*doc = xmlReadMemory(data, st.st_size, NULL, NULL, 0);
+	stats.parse = clock_us() - start;
+	munmap(data, st.st_size);
+
+	if (!*doc) {
+		record_end(0, "Invalid XML");
+		msg(LOG_ERR, "Invalid XML");
+	}
+	record_end(0, NULL);
+
+	TRACE_END();
+
+	return 1;
+}
+
+static int
+open_feed_push(xmlDocPtr *doc)
+{
+	if (!response_fits(push.size)) {
+		stats.oversized = 1;
+		check_xml();
+	}
+	stats.bytes = push.size;
+
+	stats.phase = FEED_PHASE_PARSE;
+	long long start = clock_us();
+	*doc = xmlReadMemory(push.data, push.size, NULL, NULL, 0);
+	stats.parse = clock_us() - start;
+	if (!*doc)
+		msg(LOG_ERR, "Invalid XML");
+
+	return 1;
+}
+
+static void
+context_save(struct feed_context *ctx)
+{
+	if (!getcwd(ctx->dir, sizeof ctx->dir))
+		msg(LOG_ERR, "Cannot get current directory: %s", strerror(errno));
+	strcpy(ctx->folder, opt_folder);
+	strcpy(ctx->from, opt_from);
+	ctx->digest = opt_digest;
+	ctx->prune_age = opt_prune_age;
+	ctx->prune_count = opt_prune_count;
+}
+
+static void
+context_enter(struct feed_context const *ctx)
+{
+	char dir[PATH_MAX];
+	if (!getcwd(dir, sizeof dir) || strcmp(dir, ctx->dir)) {
+		if (chdir(ctx->dir) < 0)
+			msg(LOG_ERR, "Failed to change current directory to '%s': %s",
+					ctx->dir, strerror(errno));
+		maildir_close_all();
+	}
+	strcpy(opt_folder, ctx->folder);
+	strcpy(opt_from, ctx->from);
+	opt_digest = ctx->digest;
+	opt_prune_age = ctx->prune_age;
+	opt_prune_count = ctx->prune_count;
+}
+
+/* Options that apply to the next feed only. */
+static void
+feed_options_reset(void)
+{
+	*opt_folder = '\0';
+	*opt_from = '\0';
+	opt_digest = 0;
+	opt_prune_age = 0;
+	opt_prune_count = 0;
+}
+
+static struct websub_feed *
+websub_find(char const *id)
+{
+	for (size_t i = 0; i < websub_nfeeds; ++i)
+		if (!strcmp(websub_feeds[i].id, id))
+			return &websub_feeds[i];
+	return NULL;
+}
+
+/* Remember how to process callbacks of url. */
+static void
+websub_register(char const *url)
+{
+	HASH id;
+	hash_str(id, url);
+	if (websub_find(id))
+		return;
+
+	if (websub_alloc <= websub_nfeeds) {
+		size_t n = websub_alloc ? 2 * websub_alloc : 16;
+		struct websub_feed *p = realloc(websub_feeds, n * sizeof *p);
+		if (!p)
+			msg(LOG_ERR, "Cannot allocate memory");
+		websub_feeds = p;
+		websub_alloc = n;
+	}
+
+	struct websub_feed *feed = &websub_feeds[websub_nfeeds];
+	*feed = (struct websub_feed){ 0 };
+	strcpy(feed->id, id);
+	context_save(&feed->ctx);
+	if (!(feed->url = strdup(url)))
+		msg(LOG_ERR, "Cannot allocate memory");
+	++websub_nfeeds;
+}
+
+/* Find <link rel="hub"> and <link rel="self"> of Atom feed or RSS channel. */
+static void
+websub_discover(xmlNodePtr root, xmlChar **hub, xmlChar **self)
+{
+	static xmlChar const NS_ATOM[] = "http://www.w3.org/2005/Atom";
+
+	xmlNodePtr channel = xmlGetNsChild(root, "channel", NULL);
+	if (channel)
+		root = channel;
+
+	*hub = *self = NULL;
+	for eachXmlElement(child, root) {
+		if (!xmlTestNode(child, "link", NS_ATOM))
+			continue;
+
+		xmlChar *rel = xmlGetNoNsProp(child, XML_CHAR "rel");
+		xmlChar **link =
+			!rel ? NULL :
+			!xmlStrcmp(rel, XML_CHAR "hub") ? hub :
+			!xmlStrcmp(rel, XML_CHAR "self") ? self :
+			NULL;
+		xmlFree(rel);
+		if (link && !*link)
+			*link = xmlGetNoNsProp(child, XML_CHAR "href");
+	}
+}
+
+static size_t
+discard_cb(char *buf, size_t size, size_t nmemb, void *userdata)
+{
+	(void)buf, (void)userdata;
+	return size * nmemb;
+}
+
+/* Ask hub to push updates of feed. Failure only means polling goes on. */
+static void
+websub_subscribe(xmlNodePtr root)
+{
+	xmlChar *hub, *self;
+	websub_discover(root, &hub, &self);
+	struct websub_feed *feed = websub_find(stats.id);
+	if (!curl)
+		curl = curl_easy_init();
+	if (!hub || !self || !feed || !curl) {
+		xmlFree(hub);
+		xmlFree(self);
+		return;
+	}
+
+	TRACE_BEGIN("websub_subscribe");
+
+	char callback[sizeof opt_hub_callback + sizeof(HASH) + 1];
+	size_t n = strlen(opt_hub_callback);
+	snprintf(callback, sizeof callback, "%s%s%s", opt_hub_callback,
+			n && '/' == opt_hub_callback[n - 1] ? "" : "/", stats.id);
+
+	char *topic = curl_easy_escape(curl, (char const *)self, 0);
+	char *callback_escaped = curl_easy_escape(curl, callback, 0);
+	char *secret = curl_easy_escape(curl, opt_hub_secret, 0);
+	char *fields = NULL;
+	if (topic && callback_escaped && secret &&
+	    0 > asprintf(&fields,
+			"hub.mode=subscribe&hub.topic=%s&hub.callback=%s%s%s",
+			topic, callback_escaped,
+			*opt_hub_secret ? "&hub.secret=" : "",
+			*opt_hub_secret ? secret : ""))
+		fields = NULL;
+	curl_free(topic);
+	curl_free(callback_escaped);
+	curl_free(secret);
+
+	long status_code = 0;
+	CURLcode rc = CURLE_OUT_OF_MEMORY;
+	if (fields) {
+		curl_easy_reset(curl);
+		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error_buf);
+		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)opt_verbose);
+		curl_easy_setopt(curl, CURLOPT_PROXY, opt_proxy);
+		curl_easy_setopt(curl, CURLOPT_USERAGENT,
+				*opt_user_agent ? opt_user_agent : NULL);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_cb);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, fields);
+		curl_easy_setopt(curl, CURLOPT_URL, (char const *)hub);
+		rc = curl_easy_perform(curl);
+		if (CURLE_OK == rc)
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
+		free(fields);
+	}
+
+	if (CURLE_OK != rc) {
+		msg(LOG_WARNING, "WebSub: Cannot subscribe at %s: %s",
+				hub, curl_error(rc));
+	} else if (status_code < 200 || 300 <= status_code) {
+		msg(LOG_WARNING, "WebSub: Cannot subscribe at %s: HTTP %ld",
+				hub, status_code);
+	} else {
+		msg(LOG_INFO, "WebSub: Subscription requested at %s", hub);
+		xmlFree(feed->topic);
+		feed->topic = self;
+		self = NULL;
+	}
+	xmlFree(hub);
+	xmlFree(self);
+
+	TRACE_END();
+}
+
+static void
+doc_release(void *p)
+{
+	xmlDocPtr *doc = p;
+	xmlFreeDoc(*doc);
+}
+
+static void
+xml_release(void *p)
+{
+	xmlParserCtxtPtr *xml = p;
+	if (!*xml)
+		return;
+	xmlFreeDoc((*xml)->myDoc);
+	xmlFreeParserCtxt(*xml);
+	*xml = NULL;
+}
+
+static void
+open_feed(char const *url)
+{
+	xmlParserCtxtPtr ctxt = NULL, *xml = &ctxt;
+	feed_track(xml_release, xml);
+	xmlDocPtr doc = NULL;
+	feed_track(doc_release, &doc);
+	xml_invalid = 0;
+
+	if (!push.data)
+		record_begin(url);
+
+	stats.phase = FEED_PHASE_FETCH;
+	int modified;
+	if (push.data)
+		modified = open_feed_push(&doc);
+	else if (0 <= replay_dirfd)
+		modified = open_feed_replay(xml, url);
+	else if (!strncmp(url, "system:", 7))
+		modified = open_feed_program(xml, url + 7);
+	/* Anything cURL would need to decode. */
+	else if (!strncmp(url, "file:///", 8) && !strchr(url, '%'))
+		modified = open_feed_file(&doc, url + 7);
+	else
+		modified = open_feed_curl(xml, url);
+
+	if (!modified) {
+		feed_untrack(&doc);
+		feed_untrack(xml);
+		xml_release(xml);
+		stats.result = FEED_NOT_MODIFIED;
+		stats.bytes_saved = old_state.size;
+		return;
+	}
+	new_state.size = stats.bytes;
+
+	stats.phase = FEED_PHASE_PARSE;
+	if (!doc) {
+		long long start = clock_us();
+		if (!*xml || xmlParseChunk(*xml, NULL, 0, 1 /* Terminate? */))
+			msg(LOG_ERR, "Invalid XML");
+		stats.parse += clock_us() - start;
+
+		doc = (*xml)->myDoc;
+		(*xml)->myDoc = NULL;
+	}
+	feed_untrack(xml);
+	xml_release(xml);
+
+	xmlNodePtr root = xmlDocGetRootElement(doc);
+
+	long long start = clock_us();
+	if (!atom_parse(root) &&
+	    !rss_parse(root) &&
+	    !rdf_parse(root))
+		msg(LOG_ERR, "Unexpected root node %s", root->name);
+	stats.render = clock_us() - start;
+
+	if (*opt_hub_callback && !push.data)
+		websub_subscribe(root);
+
+	feed_untrack(&doc);
+	xmlFreeDoc(doc);
+}
+
+static void
+state_read(char const *statename)
+{
+	char buf[BUFSIZ];
+	FILE *fstate = xfopen(statename, "a+");
+
+	old_state.last_modified = 0;
+	if (xfgets(buf, sizeof buf, fstate))
+		old_state.last_modified = parse_date(buf);
+
+	old_state.expiration = 0;
+	if (xfgets(buf, sizeof buf, fstate))
+		old_state.expiration = parse_date(buf);
+
+	*old_state.etag = '\0';
+	xfgets(old_state.etag, sizeof old_state.etag, fstate);
+
+	old_state.size = 0;
+	if (xfgets(buf, sizeof buf, fstate) /* URL */ &&
+	    xfgets(buf, sizeof buf, fstate))
+		old_state.size = atoll(buf);
+
+	old_state.lease = 0;
+	if (xfgets(buf, sizeof buf, fstate))
+		old_state.lease = parse_date(buf);
+
+	fclose(fstate);
+
+	new_state = old_state;
+}
+
+static void
+state_write(char const *statename, char const *url)
+{
+	char buf[50];
+	struct tmpfile t;
+	FILE *f = tmpfile_open(&t, maildir_open("")->tmp, "mrssstate.XXXXXX");
+
+	strftime(buf, sizeof buf, RFC_2616, gmtime(&new_state.last_modified));
+	fputs(buf, f);
+	fputc('\n', f);
+
+	strftime(buf, sizeof buf, RFC_2616, gmtime(&new_state.expiration));
+	fputs(buf, f);
+	fputc('\n', f);
+
+	fputs(new_state.etag, f);
+	fputc('\n', f);
+
+	fputs(url, f);
+	fputc('\n', f);
+
+	fprintf(f, "%lld\n", new_state.size);
+
+	strftime(buf, sizeof buf, RFC_2616, gmtime(&new_state.lease));
+	fputs(buf, f);
+	fputc('\n', f);
+
+	/*
+	 * Mails must hit the disk before the state that claims they have been
+	 * delivered.
+	 */
+	if (DURABILITY_BATCH <= opt_durability)
+		xfsync(f, t.name, DURABILITY_BATCH == opt_durability);
+	tmpfile_commit(&t, AT_FDCWD, statename, 0);
+	if (DURABILITY_STRICT <= opt_durability)
+		xfsyncdirat(AT_FDCWD, ".");
+}
+
+static void
+process_feed(char const *url)
+{
+	char statename[PATH_MAX];
+
+	HASH id;
+	hash_str(id, url);
+	xsnprintf(statename, sizeof statename, ".mrssstate.%s", id);
+
+	msg(LOG_DEBUG, "Processing %s %s", id, url);
+
+	state_read(statename);
+
+	time_t now = time(NULL);
+	if (push.data) {
+		/* Pushed content is always new. */
+	} else if (now + opt_expiration < old_state.lease) {
+		msg(LOG_INFO, "Subscribed for %lu minutes",
+				(unsigned long)(old_state.lease - now) / 60);
+		stats.result = FEED_CACHED;
+		return;
+	} else if (now <= old_state.expiration) {
+		msg(LOG_INFO, "Cached for %lu minutes",
+				(unsigned long)(old_state.expiration - now) / 60);
+		stats.result = FEED_CACHED;
+		return;
+	}
+
+	outbox_clear();
+	dropped_since = 0;
+	/* LMTP may accept only some of the mails. */
+	if (opt_digest || opt_max_entries || filter_count() || *opt_lmtp) {
+		char indexname[PATH_MAX];
+		xsnprintf(indexname, sizeof indexname, ".mrssindex.%s", id);
+		entry_index_read(indexname);
+	}
+	open_feed(url);
+
+	/* Delivered entries above it are skipped by the index. */
+	if (dropped_since && dropped_since <= new_state.last_modified)
+		new_state.last_modified = dropped_since - 1;
+
+	if (opt_dry_run) {
+		msg(LOG_INFO, "Dry run: %zu mails not delivered", outbox_size);
+		outbox_clear();
+		return;
+	}
+
+	stats.phase = FEED_PHASE_DELIVER;
+	long long start = clock_us();
+	TRACE_BEGIN("outbox_flush");
+	outbox_flush();
+	TRACE_END();
+	stats.deliver = clock_us() - start;
+
+	if (new_state.expiration < now + opt_expiration)
+		new_state.expiration = now + opt_expiration;
+
+	if (new_state.last_modified == old_state.last_modified &&
+	    new_state.expiration == old_state.expiration &&
+	    !strcmp(new_state.etag, old_state.etag) &&
+	    new_state.size == old_state.size &&
+	    new_state.lease == old_state.lease)
+	{
+		msg(LOG_INFO, "State not changed");
+		return;
+	}
+
+	stats.phase = FEED_PHASE_STATE;
+	TRACE_BEGIN("state");
+	start = clock_us();
+	state_write(statename, url);
+	stats.state = clock_us() - start;
+	TRACE_END();
+
+	msg(LOG_INFO, "State updated");
+}
+
+static void
+report_close(void)
+{
+	if (!report)
+		return;
+
+	report_summary(report, report_stats, report_nstats,
+			clock_us() - report_start);
+	fclose(report);
+	report = NULL;
+
+	for (size_t i = 0; i < report_nstats; ++i)
+		free(report_stats[i].url);
+	report_nstats = 0;
+}
+
+static void
+report_open(char const *pathname)
+{
+	report_close();
+	if (!*pathname)
+		return;
+	report = xfopen(pathname, "w");
+	report_start = clock_us();
+}
+
+static void
+metrics_open(char const *pathname)
+{
+	if (0 <= metrics_dirfd)
+		close(metrics_dirfd);
+	metrics_dirfd = -1;
+
+	if (!*pathname)
+		return;
+
+	char dir[PATH_MAX];
+	xsnprintf(dir, sizeof dir, "%s", pathname);
+	char *name = strrchr(dir, '/');
+	if (name) {
+		*name++ = '\0';
+		if (!*dir)
+			strcpy(dir, "/");
+	} else {
+		name = (char *)pathname;
+		strcpy(dir, ".");
+	}
+	xsnprintf(metrics_name, sizeof metrics_name, "%s", name);
+
+	metrics_dirfd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (metrics_dirfd < 0)
+		msg(LOG_ERR, "Cannot open '%s': %s", dir, strerror(errno));
+}
+
+/* Replace metrics file atomically so it is never seen half-written. */
+static void
+metrics_save(void)
+{
+	if (metrics_dirfd < 0)
+		return;
+
+	struct tmpfile t;
+	FILE *f = tmpfile_open(&t, metrics_dirfd, "mrss-metrics.XXXXXX");
+	fchmod(fileno(f), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	int fd = openat(metrics_dirfd, metrics_name, O_RDONLY | O_CLOEXEC);
+	FILE *old = 0 <= fd ? fdopen(fd, "r") : NULL;
+	metrics_write(f, old, (clock_us() - run_start) / 1e6);
+	if (old)
+		fclose(old);
+
+	tmpfile_commit(&t, metrics_dirfd, metrics_name, 0);
+}
+
+static void
+stats_commit(void)
+{
+	metrics_feed(&stats);
 
-	if (date) {
-		strftime(datetime, sizeof datetime, RFC_822, localtime(&date));
-		mail_write_hdr(&mail, "Date: %s", datetime);
-	}
+	if (!report)
+		return;
 
-	mail_write_from_hdr(&mail, feed);
-	mail_write_hdr(&mail, "Subject: %t", entry->subject);
-	mail_write_category_hdr(&mail, feed);
-	mail_write_category_hdr(&mail, entry);
-	mail_write_author_hdr(&mail, feed);
-	mail_write_author_hdr(&mail, entry);
-	mail_write_hdr(&mail, "Link: %t", entry->link);
-	if (entry->text.content) {
-		mail_write_hdr(&mail, "Content-Type: %s", entry->text.mime_type);
-		fprintf(mail.stream, "\n%s", (char const *)entry->text.content);
+	report_feed(report, &stats);
+
+	if (report_alloc <= report_nstats) {
+		size_t n = report_alloc ? 2 * report_alloc : 64;
+		struct feed_stats *p = realloc(report_stats, n * sizeof *p);
+		if (!p)
+			msg(LOG_ERR, "Cannot allocate memory");
+		report_stats = p;
+		report_alloc = n;
 	}
 
-	hash_entry(id, entry, 1);
-	mail_commit(&mail, id, 1);
+	struct feed_stats *s = &report_stats[report_nstats];
+	*s = stats;
+	s->url = strdup(stats.url);
+	if (!s->url)
+		msg(LOG_ERR, "Cannot allocate memory");
+	++report_nstats;
 }
 
 static void
-check_curl(CURLcode rc)
+programs_queue(char const *url)
 {
-	if (rc == CURLE_OK)
-		return;
+	if (programs_alloc <= nprograms) {
+		size_t n = programs_alloc ? 2 * programs_alloc : 16;
+		struct program *p = realloc(programs, n * sizeof *p);
+		if (!p)
+			msg(LOG_ERR, "Cannot allocate memory");
+		programs = p;
+		programs_alloc = n;
+	}
 
-	msg(LOG_ERR, "cURL error: %s", *curl_error_buf
-			? curl_error_buf
-			: curl_easy_strerror(rc));
+	struct program *p = &programs[nprograms];
+	*p = (struct program){ .expiration = opt_expiration };
+	p->xml = &p->ctxt;
+	context_save(&p->ctx);
+	if (!(p->url = strdup(url)))
+		msg(LOG_ERR, "Cannot allocate memory");
+	++nprograms;
 }
 
-static int
-open_feed_curl(xmlParserCtxtPtr *xml, char const *url)
+static void
+exec_cmd_url(char const *url)
 {
-	if (!curl)
-		curl = curl_easy_init();
-	if (!curl)
-		msg(LOG_ERR, "cURL error: cannot initialize");
+	/* Recorded and replayed feeds are not run. */
+	if (1 < opt_jobs && !program_finished && !push.data &&
+	    record_dirfd < 0 && replay_dirfd < 0 &&
+	    !strncmp(url, "system:", 7))
+	{
+		programs_queue(url);
+		feed_options_reset();
+		return;
+	}
 
-	struct curl_slist *headers = NULL;
-	char buf[50 + 1024];
+	stats = (struct feed_stats){
+		.url = (char *)url,
+		.result = FEED_FETCHED,
+		.phase = FEED_PHASE_STATE,
+	};
+	hash_str(stats.id, url);
+	trace_set_feed(stats.id);
 
-	if (*old_state.etag) {
-		sprintf(buf, "If-None-Match:%s", old_state.etag);
-		headers = curl_slist_append(headers, buf);
-	} else if (old_state.last_modified) {
-		char datetime[50];
-		strftime(datetime, sizeof datetime, RFC_2616,
-				gmtime(&old_state.last_modified));
-		sprintf(buf, "If-Modified-Since: %s", datetime);
-		headers = curl_slist_append(headers, buf);
+	if (*opt_hub_callback)
+		websub_register(url);
+
+	long long start = clock_us();
+
+	TRACE_BEGIN("process_feed");
+	have_errctx = 1;
+	if (!setjmp(errctx)) {
+		process_feed(url);
+		mails_prune();
+	} else {
+		msg(LOG_NOTICE, "Errored URL: %s", url);
+		stats.result = FEED_ERRORED;
+		outbox_clear();
 	}
+	have_errctx = 0;
+	/* Also ends spans left open by an error. */
+	TRACE_UNWIND();
 
-	curl_easy_reset(curl);
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error_buf);
-	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L);
-	curl_easy_setopt(curl, CURLOPT_AUTOREFERER, 1L);
-	curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)opt_verbose);
-	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
-	check_curl(curl_easy_setopt(curl, CURLOPT_PROXY, opt_proxy));
-	check_curl(curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L));
-	check_curl(curl_easy_setopt(curl, CURLOPT_SOCKS5_AUTH, CURLAUTH_BASIC));
-	check_curl(curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb));
-	check_curl(curl_easy_setopt(curl, CURLOPT_HEADERDATA, xml));
-	check_curl(curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_xml));
-	check_curl(curl_easy_setopt(curl, CURLOPT_WRITEDATA, xml));
-	check_curl(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers));
-	check_curl(curl_easy_setopt(curl, CURLOPT_USERAGENT,
-			*opt_user_agent ? opt_user_agent : NULL));
-	check_curl(curl_easy_setopt(curl, CURLOPT_URL, url));
+	stats.total = clock_us() - start;
+	stats_commit();
 
-	check_curl(curl_easy_perform(curl));
+	feed_options_reset();
+}
 
-	curl_slist_free_all(headers);
+static int
+program_parse(struct spawn_cmd *cmd, char const *buf, size_t size)
+{
+	struct program *p = cmd->data;
+	p->bytes += size;
+	if (!response_fits(p->bytes)) {
+		p->oversized = 1;
+		p->invalid = 1;
+		return 0;
+	}
+	long long start = clock_us();
+	p->invalid = !xml_push(p->xml, buf, size);
+	p->parse += clock_us() - start;
+	return !p->invalid;
+}
 
-	long status_code;
-	check_curl(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code));
+static void
+program_process(struct program *p)
+{
+	int expiration = opt_expiration;
+	context_enter(&p->ctx);
+	opt_expiration = p->expiration;
 
-	/* Non-HTTP requests return 0. */
-	return !status_code || 200 == status_code;
+	program_finished = p;
+	exec_cmd_url(p->url);
+	program_finished = NULL;
+
+	opt_expiration = expiration;
+}
+
+static void
+program_done(struct spawn_cmd *cmd, int status)
+{
+	struct program *p = cmd->data;
+	p->status = status;
+	program_process(p);
 }
 
+/* Errors are reported when the feed is processed. */
 static int
-open_feed_program(xmlParserCtxtPtr *xml, char const *command)
+program_cached(struct program const *p)
 {
-	char buf[BUFSIZ];
-	FILE *stream = popen(command, "r");
-	if (!stream)
-		msg(LOG_ERR, "Failed to execute command");
-	for (size_t n; (n = fread(buf, 1, sizeof buf, stream));)
-		write_xml(buf, 1, n, xml);
+	char statename[PATH_MAX];
+	HASH id;
+	hash_str(id, p->url);
+	xsnprintf(statename, sizeof statename, ".mrssstate.%s", id);
 
-	if (EXIT_SUCCESS == pclose(stream))
-		return 1;
-	/* No XML == not changed. */
-	else if (!xml)
+	have_errctx = 1;
+	if (setjmp(errctx)) {
+		have_errctx = 0;
 		return 0;
+	}
+	state_read(statename);
+	have_errctx = 0;
 
-	msg(LOG_ERR, "Process terminated with failure");
-	abort();
+	time_t now = time(NULL);
+	return now + p->expiration < old_state.lease ||
+	       now <= old_state.expiration;
 }
 
+/* Feeds are processed as their commands finish. */
 static void
-open_feed(char const *url)
+programs_run(void)
 {
-	xmlParserCtxtPtr xml = NULL;
+	static struct spawn_handler const HANDLER = {
+		.output = program_parse,
+		.line = program_line,
+		.done = program_done,
+	};
 
-	if (!strncmp(url, "system:", 7)) {
-		if (!open_feed_program(&xml, url + 7))
-			return;
-	} else {
-		if (!open_feed_curl(&xml, url))
-			return;
-	}
+	if (!nprograms)
+		return;
 
-	if (!xml || xmlParseChunk(xml, NULL, 0, 1 /* Terminate? */))
-		msg(LOG_ERR, "Invalid XML");
+	struct feed_context ctx;
+	context_save(&ctx);
 
-	xmlDocPtr doc = xml->myDoc;
-	xmlNodePtr root = xmlDocGetRootElement(doc);
+	struct spawn_cmd *cmds = malloc(nprograms * sizeof *cmds);
+	if (!cmds)
+		msg(LOG_ERR, "Cannot allocate memory");
 
-	if (!atom_parse(root) &&
-	    !rss_parse(root) &&
-	    !rdf_parse(root))
-		msg(LOG_ERR, "Unexpected root node %s", root->name);
+	/* Cached feeds need no command. */
+	size_t ncmds = 0;
+	for (size_t i = 0; i < nprograms; ++i) {
+		struct program *p = &programs[i];
+		context_enter(&p->ctx);
+		if (program_cached(p)) {
+			program_process(p);
+			continue;
+		}
+
+		program_env(p);
+		cmds[ncmds++] = (struct spawn_cmd){
+			.command = p->url + 7,
+			.envp = p->env,
+			.data = p,
+		};
+	}
 
-	xmlFreeParserCtxt(xml);
+	struct spawn_limits limits = program_limits();
+	spawn_run(cmds, ncmds, opt_jobs, &limits, &HANDLER);
+	free(cmds);
+
+	for (size_t i = 0; i < nprograms; ++i) {
+		xml_release(&programs[i].ctxt);
+		program_release(&programs[i]);
+		free(programs[i].url);
+	}
+	nprograms = 0;
+
+	context_enter(&ctx);
+	feed_options_reset();
 }
 
 static void
-process_feed(char const *url)
+import_doc(char const *name, xmlDocPtr doc)
 {
-	char statename[PATH_MAX];
+	msg(LOG_DEBUG, "Importing %s", name);
 
-	HASH id;
-	hash_str(id, url);
-	xsnprintf(statename, sizeof statename, ".mrssstate.%s", id);
+	xmlNodePtr root = xmlDocGetRootElement(doc);
+	if (!root ||
+	    (!atom_parse(root) &&
+	     !rss_parse(root) &&
+	     !rdf_parse(root)))
+		msg(LOG_WARNING, "Unexpected root node in '%s'", name);
+}
 
-	msg(LOG_DEBUG, "Processing %s %s", id, url);
+/* Deliver mails of a window of snapshots so memory stays bounded. */
+static void
+import_flush(void)
+{
+	for (size_t i = 0; i < outbox_size; ++i)
+		delivered_add(outbox[i].name);
 
-	char buf[BUFSIZ];
-	FILE *fstate = xfopen(statename, "a+");
+	if (opt_dry_run) {
+		stats.mails += outbox_size;
+		outbox_clear();
+		return;
+	}
 
-	old_state.last_modified = 0;
-	if (xfgets(buf, sizeof buf, fstate))
-		old_state.last_modified = parse_date(buf);
-	new_state.last_modified = old_state.last_modified;
+	long long start = clock_us();
+	stats.phase = FEED_PHASE_DELIVER;
+	outbox_flush();
+	stats.phase = FEED_PHASE_PARSE;
+	stats.deliver += clock_us() - start;
+}
 
-	old_state.expiration = 0;
-	if (xfgets(buf, sizeof buf, fstate))
-		old_state.expiration = parse_date(buf);
-	new_state.expiration = old_state.expiration;
+/*
+ * Turn every snapshot into mails. State is neither used nor updated, and mails
+ * are delivered after every window of snapshots.
+ */
+static void
+exec_cmd_import(char const *path)
+{
+	static struct import_handler const HANDLER = {
+		.process = import_doc,
+		.flush = import_flush,
+	};
 
-	*old_state.etag = '\0';
-	xfgets(old_state.etag, sizeof old_state.etag, fstate);
-	strcpy(new_state.etag, old_state.etag);
+	stats = (struct feed_stats){
+		.url = (char *)path,
+		.result = FEED_FETCHED,
+		.phase = FEED_PHASE_PARSE,
+	};
+	memset(&old_state, 0, sizeof old_state);
+	memset(&new_state, 0, sizeof new_state);
 
-	fclose(fstate);
+	TRACE_BEGIN("import");
+	have_errctx = 1;
+	if (!setjmp(errctx)) {
+		long long start = clock_us();
+		outbox_clear();
+		import_feeds(path, &HANDLER);
+		stats.parse = clock_us() - start - stats.deliver;
+
+		msg(LOG_INFO, "Imported %zu entries, %zu duplicates",
+				stats.entries_new - stats.entries_duplicate,
+				stats.entries_duplicate);
+
+		if (opt_dry_run) {
+			msg(LOG_INFO, "Dry run: %zu mails not delivered", stats.mails);
+			stats.mails = 0;
+		}
+	} else {
+		msg(LOG_NOTICE, "Errored import: %s", path);
+		outbox_clear();
+	}
+	delivered_clear();
+	have_errctx = 0;
+	TRACE_UNWIND();
 
-	time_t now = time(NULL);
-	if (now <= old_state.expiration) {
-		msg(LOG_INFO, "Cached for %lu minutes",
-				(unsigned long)(old_state.expiration - now) / 60);
-		return;
+	feed_options_reset();
+}
+
+static void
+hmac_sha1(BYTE mac[static SHA1_BLOCK_SIZE], char const *key,
+		void const *data, size_t size)
+{
+	SHA1_CTX ctx;
+	BYTE k[64] = { 0 };
+	size_t key_size = strlen(key);
+	if (sizeof k < key_size) {
+		sha1_init(&ctx);
+		sha1_update(&ctx, (BYTE const *)key, key_size);
+		sha1_final(&ctx, k);
+	} else {
+		memcpy(k, key, key_size);
 	}
 
-	xmkdir("tmp");
-	xmkdir("new");
-	xmkdir("cur");
+	BYTE pad[sizeof k], inner[SHA1_BLOCK_SIZE];
+	for (size_t i = 0; i < sizeof k; ++i)
+		pad[i] = k[i] ^ 0x36;
+	sha1_init(&ctx);
+	sha1_update(&ctx, pad, sizeof pad);
+	sha1_update(&ctx, data, size);
+	sha1_final(&ctx, inner);
 
-	open_feed(url);
+	for (size_t i = 0; i < sizeof k; ++i)
+		pad[i] = k[i] ^ 0x5c;
+	sha1_init(&ctx);
+	sha1_update(&ctx, pad, sizeof pad);
+	sha1_update(&ctx, inner, sizeof inner);
+	sha1_final(&ctx, mac);
+}
 
-	if (new_state.expiration < now + opt_expiration)
-		new_state.expiration = now + opt_expiration;
+/* X-Hub-Signature is "sha1=HEX". */
+static int
+websub_check_signature(char const *signature, char const *body, size_t size)
+{
+	static char const HEX[16] = "0123456789abcdef";
 
-	if (new_state.last_modified == old_state.last_modified &&
-	    new_state.expiration == old_state.expiration &&
-	    !strcmp(new_state.etag, old_state.etag))
-	{
-		msg(LOG_INFO, "State not changed");
-		return;
-	}
+	if (strncmp(signature, "sha1=", 5) ||
+	    2 * SHA1_BLOCK_SIZE != strlen(signature + 5))
+		return 0;
+	signature += 5;
 
-	char tmpname[PATH_MAX];
-	strcpy(tmpname, "tmp/mrssstate.XXXXXX");
-	FILE *f = xftmpopen(tmpname);
+	BYTE mac[SHA1_BLOCK_SIZE];
+	hmac_sha1(mac, opt_hub_secret, body, size);
 
-	strftime(buf, sizeof buf, RFC_2616, gmtime(&new_state.last_modified));
-	fputs(buf, f);
-	fputc('\n', f);
+	int diff = 0;
+	for (size_t i = 0; i < sizeof mac; ++i)
+		diff |= (HEX[mac[i] >> 4] ^ tolower(signature[2 * i])) |
+		        (HEX[mac[i] & 0xf] ^ tolower(signature[2 * i + 1]));
+	return !diff;
+}
 
-	strftime(buf, sizeof buf, RFC_2616, gmtime(&new_state.expiration));
-	fputs(buf, f);
-	fputc('\n', f);
+static int
+websub_verify(char const *id, char const *mode, char const *topic,
+		long lease_seconds)
+{
+	struct websub_feed *feed = websub_find(id);
+	if (!feed)
+		return 0;
 
-	fputs(new_state.etag, f);
-	fputc('\n', f);
+	int subscribe = !strcmp(mode, "subscribe");
+	/* Only confirm what has been asked for. */
+	if (subscribe &&
+	    (!feed->topic || xmlStrcmp(feed->topic, XML_CHAR topic)))
+		return 0;
+	if (!subscribe && strcmp(mode, "unsubscribe") && strcmp(mode, "denied"))
+		return 0;
 
-	fputs(url, f);
-	fputc('\n', f);
+	int ok = 0;
+	have_errctx = 1;
+	if (!setjmp(errctx)) {
+		context_enter(&feed->ctx);
+
+		char statename[PATH_MAX];
+		xsnprintf(statename, sizeof statename, ".mrssstate.%s", id);
+		state_read(statename);
+		new_state.lease = subscribe ? time(NULL) + lease_seconds : 0;
+		state_write(statename, feed->url);
+
+		msg(LOG_INFO, "WebSub: %s %s for %ld seconds",
+				mode, feed->url, subscribe ? lease_seconds : 0);
+		ok = 1;
+	}
+	have_errctx = 0;
 
-	xfclose(f, tmpname);
-	xrename(tmpname, statename);
+	feed_options_reset();
 
-	msg(LOG_INFO, "State updated");
+	return ok;
 }
 
 static void
-exec_cmd_url(char const *url)
+websub_push(char const *id, char const *body, size_t size,
+		char const *signature)
 {
+	struct websub_feed *feed = websub_find(id);
+	if (!feed)
+		return;
+
+	/* Hub expects 2xx even for bad signatures. */
+	if (*opt_hub_secret && !websub_check_signature(signature, body, size)) {
+		msg(LOG_WARNING, "WebSub: Invalid signature for %s", feed->url);
+		return;
+	}
+
+	/* Enter the directory and options feed was registered with. */
 	have_errctx = 1;
-	if (!setjmp(errctx))
-		process_feed(url);
-	else
-		msg(LOG_NOTICE, "Errored URL: %s", url);
+	if (setjmp(errctx)) {
+		have_errctx = 0;
+		feed_options_reset();
+		return;
+	}
+	context_enter(&feed->ctx);
 	have_errctx = 0;
 
-	*opt_from = '\0';
+	msg(LOG_INFO, "WebSub: Received %zu bytes for %s", size, feed->url);
+	push.data = body;
+	push.size = size;
+	exec_cmd_url(feed->url);
+	push.data = NULL;
+}
+
+static void
+exec_cmd_serve(char const *addr)
+{
+	static struct websub_handler const HANDLER = {
+		.verify = websub_verify,
+		.push = websub_push,
+	};
+	programs_run();
+	websub_serve(addr, &HANDLER);
 }
 
 static void
@@ -884,6 +3978,7 @@ exec_cmd_urls(char const *pathname)
 	fclose(f);
 }
 
+
 static void
 exec_cmd(char const *cmd, char const *arg);
 
@@ -953,6 +4048,17 @@ set_choice_opt(int *b, char const *arg)
 		msg(LOG_ERR, "Invalid boolean value: '%s'", arg);
 }
 
+static void
+set_enum_opt(int *value, char const *arg, char const *const *names)
+{
+	for (int i = 0; names[i]; ++i)
+		if (!strcmp(arg, names[i])) {
+			*value = i;
+			return;
+		}
+	msg(LOG_ERR, "Invalid value: '%s'", arg);
+}
+
 static void
 set_int_opt(int *value, char const *arg)
 {
@@ -988,30 +4094,170 @@ set_int_opt(int *value, char const *arg)
 	*value *= unit;
 }
 
+/* "drop FIELD PATTERN" or "folder=NAME FIELD PATTERN". */
+static void
+exec_cmd_filter(char const *arg)
+{
+	static char const *const FIELDS[] = {
+		[FILTER_SUBJECT] = "subject",
+		[FILTER_LINK] = "link",
+		[FILTER_AUTHOR] = "author",
+		[FILTER_CATEGORY] = "category",
+		[FILTER_LANG] = "lang",
+		NULL,
+	};
+
+	char buf[1024];
+	set_str_opt(buf, sizeof buf, arg);
+
+	char *action = buf;
+	char *field = action + strcspn(action, " \t");
+	if (*field)
+		*field++ = '\0';
+	field += strspn(field, " \t");
+	char *pattern = field + strcspn(field, " \t");
+	if (*pattern)
+		*pattern++ = '\0';
+	pattern += strspn(pattern, " \t");
+	if (!*pattern)
+		msg(LOG_ERR, "Invalid filter: '%s'", arg);
+
+	char const *folder = NULL;
+	if (!strncmp(action, "folder=", 7)) {
+		folder = action + 7;
+		if (sizeof opt_folder <= strlen(folder))
+			msg(LOG_ERR, "Argument '%s': too long", folder);
+	} else if (strcmp(action, "drop")) {
+		msg(LOG_ERR, "Invalid filter action: '%s'", action);
+	}
+
+	int value = 0;
+	set_enum_opt(&value, field, FIELDS);
+	filter_add(value, pattern, folder);
+}
+
+/* Plain number is a count, number with unit an age. */
+static void
+set_prune_opt(char const *arg)
+{
+	char *end;
+	long n = strtol(arg, &end, 10);
+	opt_prune_age = 0;
+	opt_prune_count = 0;
+	if (arg != end && !*end && 0 <= n && n <= INT_MAX)
+		opt_prune_count = n;
+	else
+		set_int_opt(&opt_prune_age, arg);
+}
+
 static void
 exec_cmd(char const *cmd, char const *arg)
 {
+	/* Rules added so far are complete. */
+	if (strcmp(cmd, "filter"))
+		filter_compile();
+
 	if (!strcmp(cmd, "cd")) {
 		char path[PATH_MAX];
 		set_shellstr_opt(path, sizeof path, arg);
 		if (chdir(path) < 0)
 			msg(LOG_ERR, "Failed to change current directory to '%s': %s",
 					path, strerror(errno));
-	} else if (!strcmp(cmd, "config"))
+		maildir_close_all();
+	} else if (!strcmp(cmd, "command_cpu"))
+		set_int_opt(&opt_command_cpu, arg);
+	else if (!strcmp(cmd, "command_memory"))
+		set_int_opt(&opt_command_memory, arg);
+	else if (!strcmp(cmd, "command_timeout"))
+		set_int_opt(&opt_command_timeout, arg);
+	else if (!strcmp(cmd, "config"))
 		exec_cmd_file(arg);
-	else if (!strcmp(cmd, "expire"))
+	else if (!strcmp(cmd, "dedup"))
+		set_choice_opt(&opt_dedup, arg);
+	else if (!strcmp(cmd, "digest"))
+		set_choice_opt(&opt_digest, arg);
+	else if (!strcmp(cmd, "dry_run"))
+		set_choice_opt(&opt_dry_run, arg);
+	else if (!strcmp(cmd, "durability")) {
+		static char const *const NAMES[] = {
+			[DURABILITY_NONE] = "none",
+			[DURABILITY_BATCH] = "batch",
+			[DURABILITY_STRICT] = "strict",
+			NULL,
+		};
+		int value = opt_durability;
+		set_enum_opt(&value, arg, NAMES);
+		opt_durability = value;
+	} else if (!strcmp(cmd, "expire"))
 		set_int_opt(&opt_expiration, arg);
+	else if (!strcmp(cmd, "filter"))
+		exec_cmd_filter(arg);
+	else if (!strcmp(cmd, "folder"))
+		set_str_opt(opt_folder, sizeof opt_folder, arg);
 	else if (!strcmp(cmd, "from"))
 		set_str_opt(opt_from, sizeof opt_from, arg);
 	else if (!strcmp(cmd, "include")) {
 		char path[PATH_MAX];
 		set_shellstr_opt(path, sizeof path, arg);
 		exec_cmd_file(path);
+	} else if (!strcmp(cmd, "hub_callback"))
+		set_str_opt(opt_hub_callback, sizeof opt_hub_callback, arg);
+	else if (!strcmp(cmd, "hub_secret"))
+		set_str_opt(opt_hub_secret, sizeof opt_hub_secret, arg);
+	else if (!strcmp(cmd, "image_ttl"))
+		set_int_opt(&opt_image_ttl, arg);
+	else if (!strcmp(cmd, "import")) {
+		char path[PATH_MAX];
+		set_shellstr_opt(path, sizeof path, arg);
+		exec_cmd_import(path);
+	} else if (!strcmp(cmd, "inline_images"))
+		set_choice_opt(&opt_inline_images, arg);
+	else if (!strcmp(cmd, "io_uring"))
+		set_choice_opt(&opt_io_uring, arg);
+	else if (!strcmp(cmd, "jobs"))
+		set_int_opt(&opt_jobs, arg);
+	else if (!strcmp(cmd, "lmtp"))
+		set_shellstr_opt(opt_lmtp, sizeof opt_lmtp, arg);
+	else if (!strcmp(cmd, "lmtp_recipient"))
+		set_str_opt(opt_lmtp_recipient, sizeof opt_lmtp_recipient, arg);
+	else if (!strcmp(cmd, "max_entries"))
+		set_int_opt(&opt_max_entries, arg);
+	else if (!strcmp(cmd, "max_entry_size"))
+		set_int_opt(&opt_max_entry_size, arg);
+	else if (!strcmp(cmd, "max_response_size"))
+		set_int_opt(&opt_max_response_size, arg);
+	else if (!strcmp(cmd, "metrics")) {
+		char path[PATH_MAX];
+		set_shellstr_opt(path, sizeof path, arg);
+		metrics_open(path);
 	} else if (!strcmp(cmd, "proxy"))
 		set_str_opt(opt_proxy, sizeof opt_proxy, arg);
+	else if (!strcmp(cmd, "prune"))
+		set_prune_opt(arg);
+	else if (!strcmp(cmd, "record")) {
+		char path[PATH_MAX];
+		set_shellstr_opt(path, sizeof path, arg);
+		cassette_open(&record_dirfd, path, 1);
+	} else if (!strcmp(cmd, "replay")) {
+		char path[PATH_MAX];
+		set_shellstr_opt(path, sizeof path, arg);
+		cassette_open(&replay_dirfd, path, 0);
+	} else if (!strcmp(cmd, "replace"))
+		set_choice_opt(&opt_replace, arg);
 	else if (!strcmp(cmd, "reply_to"))
 		set_choice_opt(&opt_reply_to, arg);
-	else if (!strcmp(cmd, "url"))
+	else if (!strcmp(cmd, "report")) {
+		char path[PATH_MAX];
+		set_shellstr_opt(path, sizeof path, arg);
+		report_open(path);
+	} else if (!strcmp(cmd, "serve"))
+		exec_cmd_serve(arg);
+	else if (!strcmp(cmd, "trace")) {
+		char path[PATH_MAX];
+		set_shellstr_opt(path, sizeof path, arg);
+		if (trace_open(path))
+			msg(LOG_ERR, "Cannot open '%s': %s", path, strerror(errno));
+	} else if (!strcmp(cmd, "url"))
 		exec_cmd_url(arg);
 	else if (!strcmp(cmd, "urls"))
 		exec_cmd_urls(arg);
@@ -1024,11 +4270,43 @@ exec_cmd(char const *cmd, char const *arg)
 		msg(LOG_ERR, "Unknown command: '%s'", cmd);
 }
 
+/* Free everything so memory checkers see no leaks. */
+static void
+cleanup(void)
+{
+	record_abort();
+	cassette_open(&record_dirfd, "", 1);
+	cassette_open(&replay_dirfd, "", 0);
+	metrics_open("");
+	filter_free();
+	maildir_close_all();
+	outbox_clear();
+	free(outbox);
+	free(outbox_index);
+	for (size_t i = 0; i < websub_nfeeds; ++i) {
+		free(websub_feeds[i].url);
+		xmlFree(websub_feeds[i].topic);
+	}
+	free(websub_feeds);
+	free(programs);
+	free(report_stats);
+#ifdef HAVE_IO_URING
+	if (0 < ring_state)
+		uring_exit(&ring);
+#endif
+	if (curl)
+		curl_easy_cleanup(curl);
+	curl_global_cleanup();
+	xmlCleanupParser();
+}
+
 int
 main(int argc, char *argv[])
 {
 	LIBXML_TEST_VERSION;
 
+	run_start = clock_us();
+
 	/* Parsing %Z modifies timezone so it has to be saved. */
 	tzset();
 	local_timezone = timezone;
@@ -1053,5 +4331,13 @@ main(int argc, char *argv[])
 		exec_cmd(cmd, arg);
 	}
 
+	filter_compile();
+	programs_run();
+
+	report_close();
+	metrics_save();
+	trace_close();
+	cleanup();
+
 	return EXIT_SUCCESS;
 }
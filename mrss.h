@@ -1,10 +1,14 @@
 #ifndef MRSS_H
 #define MRSS_H
 
+#include <stdio.h>
+
 #include "xml_utils.h"
 
 #define ARRAY_IN(arr, x) ((x) < ((&arr)[1]))
 
+typedef char HASH[16 + 1 /* NUL */];
+
 static char const MIME_TEXT_HTML[] = "text/html; charset=utf-8";
 static char const MIME_TEXT_PLAIN[] = "text/plain; charset=utf-8";
 
@@ -13,18 +17,23 @@ struct media {
 	xmlChar *content;
 };
 
-struct entry_author {
-	xmlChar *name;
-	xmlChar *email;
-};
-
-struct entry_category {
-	xmlChar *name;
+/* Interned strings in insertion order. */
+struct strset {
+	xmlChar const **items;
+	size_t n;
+	size_t alloc;
+	/* Open addressing of one-based item indices, 2 * alloc slots. */
+	size_t *index;
 };
 
 struct entry {
-	struct entry_author authors[8];
-	struct entry_category categories[16];
+	/* Names of authors and categories are interned per feed. */
+	struct strset authors;
+	/* E-mail address of authors, may be NULL. */
+	xmlChar const **emails;
+	struct strset categories;
+	/* URLs of image enclosures. */
+	struct strset images;
 	xmlChar *date;
 	xmlChar *id;
 	xmlChar *lang;
@@ -34,11 +43,201 @@ struct entry {
 	struct entry const *feed;
 };
 
+/* Committed, not yet delivered mail. */
+struct outbox_mail {
+	HASH name;
+	/* Same for every version of entry. */
+	HASH id;
+	/* Feed independent hash of entry. Empty if not deduplicated. */
+	HASH content;
+	/* Maildir++ folder chosen by a filter. NULL for the current one. */
+	char const *folder;
+	int new;
+	/* HTML body whose images are yet to be inlined. */
+	char *html;
+	char *data;
+	size_t size;
+};
+
+enum feed_result {
+	FEED_FETCHED,
+	FEED_NOT_MODIFIED,
+	FEED_CACHED,
+	FEED_ERRORED,
+};
+
+/* What the feed was doing last. */
+enum feed_phase {
+	FEED_PHASE_STATE,
+	FEED_PHASE_FETCH,
+	FEED_PHASE_PARSE,
+	FEED_PHASE_DELIVER,
+};
+
+/* Times are in microseconds. */
+struct feed_stats {
+	HASH id;
+	char *url;
+	enum feed_result result;
+	enum feed_phase phase;
+	long status;
+	long long dns;
+	long long connect;
+	long long tls;
+	long long first_byte;
+	long long fetch;
+	long long parse;
+	long long render;
+	long long deliver;
+	long long state;
+	long long total;
+	long long bytes;
+	/* Size of the last full response if not modified. */
+	long long bytes_saved;
+	size_t entries_seen;
+	size_t entries_new;
+	/* Entries already queued, e.g. by another imported snapshot. */
+	size_t entries_duplicate;
+	size_t mails;
+	/* Mails hardlinked from the deduplication store. */
+	size_t mails_linked;
+	size_t root_mails_skipped;
+	/* Mails removed past retention limit. */
+	size_t mails_pruned;
+	/* Mails that replaced their previous version. */
+	size_t mails_replaced;
+	/* Entries cut at max_entry_size. */
+	size_t entries_truncated;
+	/* New entries over max_entries. */
+	size_t entries_dropped;
+	/* New entries dropped by a filter. */
+	size_t entries_filtered;
+	/* Response exceeded max_response_size. */
+	int oversized;
+};
+
+void msg(int priority, char const *format, ...);
+/* Replace trailing XXXXXX of template like mkstemp(). */
+void fill_tmpname(char *template);
+/* Name of SHA-1 digest. */
+void hash_from_sha1(HASH hash, unsigned char const bytes[static 16]);
+
 void entry_process(struct entry const *entry);
+void entry_track(struct entry *entry);
 void entry_uninit(struct entry *entry);
+/* Take ownership of strings. Repeated names are ignored. */
+void entry_add_author(struct entry *entry, xmlChar *name, xmlChar *email);
+void entry_add_category(struct entry *entry, xmlChar *name);
+void entry_add_image(struct entry *entry, xmlChar *url);
+int strset_has(struct strset const *set, xmlChar const *s);
+
+/*
+ * Register resource of the current feed. If processing errors, release()
+ * is called on everything still registered, innermost first.
+ */
+void feed_track(void (*release)(void *), void *data);
+void feed_untrack(void *data);
+void feed_release(void);
 
 int atom_parse(xmlNodePtr);
 int rdf_parse(xmlNodePtr);
 int rss_parse(xmlNodePtr);
 
+void report_feed(FILE *stream, struct feed_stats const *s);
+void report_summary(FILE *stream, struct feed_stats const *stats, size_t nstats,
+		long long wall);
+
+void metrics_feed(struct feed_stats const *s);
+void metrics_write(FILE *stream, FILE *old, double run_duration);
+
+struct import_handler {
+	void (*process)(char const *name, xmlDocPtr doc);
+	/* Deliver mails of documents processed so far. */
+	void (*flush)(void);
+};
+
+void import_feeds(char const *path, struct import_handler const *handler);
+
+struct websub_handler {
+	/* Returns whether hub may change subscription of feed id. */
+	int (*verify)(char const *id, char const *mode, char const *topic,
+			long lease_seconds);
+	void (*push)(char const *id, char const *body, size_t size,
+			char const *signature);
+};
+
+void websub_serve(char const *addr, struct websub_handler const *handler);
+
+struct spawn_cmd {
+	char const *command;
+	/* NULL to inherit. */
+	char **envp;
+	void *data;
+};
+
+/* Zero means unlimited. */
+struct spawn_limits {
+	/* Seconds of wall-clock time. */
+	long timeout;
+	/* Seconds of CPU time. */
+	long cpu;
+	/* Bytes of address space. */
+	long long memory;
+};
+
+struct spawn_handler {
+	/* Returns zero to kill the command. */
+	int (*output)(struct spawn_cmd *cmd, char const *buf, size_t size);
+	/* Lines written to file descriptor 3. Optional. */
+	void (*line)(struct spawn_cmd *cmd, char const *line);
+	/* Status is as returned by waitpid(). */
+	void (*done)(struct spawn_cmd *cmd, int status);
+};
+
+/* Run shell commands, at most parallel at a time. */
+void spawn_run(struct spawn_cmd *cmds, size_t ncmds, size_t parallel,
+		struct spawn_limits const *limits,
+		struct spawn_handler const *handler);
+
+struct image {
+	char const *url;
+	/* Set by images_fetch() if image is available. */
+	char mime_type[64];
+	HASH blob;
+};
+
+struct image_options {
+	char const *proxy;
+	char const *user_agent;
+	/* Seconds before cached images are revalidated. */
+	long ttl;
+};
+
+/* Fetch images into cache directory, in parallel. */
+void images_fetch(int dirfd, struct image *images, size_t nimages,
+		struct image_options const *opts);
+int images_write_part(FILE *stream, int dirfd, struct image const *image);
+
+enum filter_field {
+	FILTER_SUBJECT,
+	FILTER_LINK,
+	FILTER_AUTHOR,
+	FILTER_CATEGORY,
+	FILTER_LANG,
+	FILTER_NFIELDS,
+};
+
+/* Rules are tried in the order they were added. NULL folder drops entry. */
+void filter_add(enum filter_field field, char const *pattern, char const *folder);
+/* Build matcher of rules added so far. Must precede filter_match(). */
+void filter_compile(void);
+size_t filter_count(void);
+/* Return whether a rule matched and its folder. */
+int filter_match(struct entry const *entry, char const **folder);
+void filter_free(void);
+
+/* Temporarily failed mails are moved to the front. Return their number. */
+size_t lmtp_deliver(char const *path, char const *recipient,
+		struct outbox_mail *mails, size_t nmails);
+
 #endif
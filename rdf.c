@@ -1,4 +1,5 @@
 #include "mrss.h"
+#include "trace.h"
 
 /* @see https://web.resource.org/rss/1.0/spec */
 /* @see http://purl.org/dc/elements/1.1/ */
@@ -52,6 +53,7 @@ rdf_parse_item(xmlNodePtr node, struct entry const *feed)
 		},
 		.feed = feed,
 	};
+	entry_track(&entry);
 	if (!entry.lang)
 		entry.lang = xmlStrdup(feed->lang);
 
@@ -80,6 +82,7 @@ rdf_parse_channel(xmlNodePtr node, xmlNodePtr rdf)
 		},
 		.feed = NULL,
 	};
+	entry_track(&feed);
 
 	for eachXmlElement(child, seq) {
 		if (!xmlTestNode(child, "li", NS_RDF))
@@ -101,9 +104,13 @@ rdf_parse(xmlNodePtr node)
 	if (!xmlTestNode(node, "RDF", NS_RDF))
 		return 0;
 
+	TRACE_BEGIN("rdf_parse");
+
 	for eachXmlElement(child, node)
 		if (xmlTestNode(child, "channel", NS_RSS10))
 			rdf_parse_channel(child, node);
 
+	TRACE_END();
+
 	return 1;
 }
@@ -0,0 +1,148 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "mrss.h"
+
+static char const *const RESULT_NAMES[] = {
+	[FEED_FETCHED] = "fetched",
+	[FEED_NOT_MODIFIED] = "not_modified",
+	[FEED_CACHED] = "cached",
+	[FEED_ERRORED] = "errored",
+};
+
+/* Timings summarized by percentiles. */
+static struct {
+	char const *name;
+	size_t offset;
+} const TIMINGS[] = {
+	{ "dns_ms", offsetof(struct feed_stats, dns) },
+	{ "connect_ms", offsetof(struct feed_stats, connect) },
+	{ "tls_ms", offsetof(struct feed_stats, tls) },
+	{ "first_byte_ms", offsetof(struct feed_stats, first_byte) },
+	{ "fetch_ms", offsetof(struct feed_stats, fetch) },
+	{ "parse_ms", offsetof(struct feed_stats, parse) },
+	{ "render_ms", offsetof(struct feed_stats, render) },
+	{ "deliver_ms", offsetof(struct feed_stats, deliver) },
+	{ "state_ms", offsetof(struct feed_stats, state) },
+	{ "total_ms", offsetof(struct feed_stats, total) },
+};
+
+static long long
+get_timing(struct feed_stats const *s, size_t i)
+{
+	return *(long long const *)((char const *)s + TIMINGS[i].offset);
+}
+
+static void
+json_write_str(FILE *stream, char const *s)
+{
+	fputc('"', stream);
+	for (; *s; ++s) {
+		unsigned char c = *s;
+		if ('"' == c || '\\' == c)
+			fprintf(stream, "\\%c", c);
+		else if (c < ' ')
+			fprintf(stream, "\\u%04x", c);
+		else
+			fputc(c, stream);
+	}
+	fputc('"', stream);
+}
+
+static void
+json_write_ms(FILE *stream, char const *name, long long us)
+{
+	fprintf(stream, ",\"%s\":%lld.%03lld", name, us / 1000, us % 1000);
+}
+
+void
+report_feed(FILE *stream, struct feed_stats const *s)
+{
+	fputs("{\"url\":", stream);
+	json_write_str(stream, s->url);
+	fprintf(stream, ",\"id\":\"%s\",\"result\":\"%s\",\"status\":%ld",
+			s->id, RESULT_NAMES[s->result], s->status);
+	for (size_t i = 0; i < sizeof TIMINGS / sizeof *TIMINGS; ++i)
+		json_write_ms(stream, TIMINGS[i].name, get_timing(s, i));
+	fprintf(stream, ",\"bytes\":%lld,\"entries_seen\":%zu,\"entries_new\":%zu,\"mails\":%zu}\n",
+			s->bytes, s->entries_seen, s->entries_new, s->mails);
+	fflush(stream);
+}
+
+static int
+cmp_ll(void const *a, void const *b)
+{
+	long long x = *(long long const *)a, y = *(long long const *)b;
+	return (y < x) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted values. */
+static long long
+percentile(long long const *values, size_t n, int p)
+{
+	if (!n)
+		return 0;
+	size_t rank = (n * p + 99) / 100;
+	return values[rank ? rank - 1 : 0];
+}
+
+void
+report_summary(FILE *stream, struct feed_stats const *stats, size_t nstats,
+		long long wall)
+{
+	size_t nresults[sizeof RESULT_NAMES / sizeof *RESULT_NAMES] = { 0 };
+	long long bytes = 0;
+	size_t entries_seen = 0, entries_new = 0, mails = 0;
+	size_t entries_truncated = 0, entries_dropped = 0, oversized = 0;
+	size_t entries_filtered = 0;
+	for (size_t i = 0; i < nstats; ++i) {
+		struct feed_stats const *s = &stats[i];
+		++nresults[s->result];
+		bytes += s->bytes;
+		entries_seen += s->entries_seen;
+		entries_new += s->entries_new;
+		mails += s->mails;
+		entries_truncated += s->entries_truncated;
+		entries_dropped += s->entries_dropped;
+		oversized += s->oversized;
+		entries_filtered += s->entries_filtered;
+	}
+
+	fprintf(stream, "{\"summary\":true,\"feeds\":%zu", nstats);
+	for (size_t i = 0; i < sizeof RESULT_NAMES / sizeof *RESULT_NAMES; ++i)
+		fprintf(stream, ",\"%s\":%zu", RESULT_NAMES[i], nresults[i]);
+	fprintf(stream, ",\"bytes\":%lld,\"entries_seen\":%zu,\"entries_new\":%zu,\"mails\":%zu",
+			bytes, entries_seen, entries_new, mails);
+	fprintf(stream, ",\"entries_truncated\":%zu,\"entries_dropped\":%zu,\"oversized\":%zu",
+			entries_truncated, entries_dropped, oversized);
+	fprintf(stream, ",\"entries_filtered\":%zu", entries_filtered);
+	json_write_ms(stream, "wall_ms", wall);
+
+	long long *values = malloc((nstats ? nstats : 1) * sizeof *values);
+	if (!values)
+		msg(LOG_ERR, "Cannot allocate memory");
+
+	/* Cached feeds would only add zeros. */
+	for (size_t i = 0; i < sizeof TIMINGS / sizeof *TIMINGS; ++i) {
+		long long sum = 0;
+		size_t n = 0;
+		for (size_t j = 0; j < nstats; ++j)
+			if (FEED_CACHED != stats[j].result)
+				sum += values[n++] = get_timing(&stats[j], i);
+		qsort(values, n, sizeof *values, cmp_ll);
+
+		fprintf(stream, ",\"%s\":{\"sum\":", TIMINGS[i].name);
+		fprintf(stream, "%lld.%03lld", sum / 1000, sum % 1000);
+		json_write_ms(stream, "p50", percentile(values, n, 50));
+		json_write_ms(stream, "p95", percentile(values, n, 95));
+		json_write_ms(stream, "p99", percentile(values, n, 99));
+		json_write_ms(stream, "max", percentile(values, n, 100));
+		fputc('}', stream);
+	}
+	fputs("}\n", stream);
+	fflush(stream);
+
+	free(values);
+}
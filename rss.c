@@ -1,4 +1,5 @@
 #include "mrss.h"
+#include "trace.h"
 
 /* @see https://validator.w3.org/feed/docs/rss2.html */
 /* @see https://web.resource.org/rss/1.0/modules/content/ */
@@ -8,30 +9,30 @@ static xmlChar const NS_CONTENT[] = "http://purl.org/rss/1.0/modules/content/";
 static void
 rss_parse_authors(xmlNodePtr node, struct entry *e)
 {
-	struct entry_author *author = e->authors;
-	for eachXmlElement(child, node) {
-		if (!xmlTestNode(child, "author", NULL))
-			continue;
-		if (!ARRAY_IN(e->authors, author))
-			break;
-
-		author->name = xmlNodeGetContent(child);
-		++author;
-	}
+	for eachXmlElement(child, node)
+		if (xmlTestNode(child, "author", NULL))
+			entry_add_author(e, xmlNodeGetContent(child), NULL);
 }
 
 static void
 rss_parse_category(xmlNodePtr node, struct entry *e)
 {
-	struct entry_category *category = e->categories;
+	for eachXmlElement(child, node)
+		if (xmlTestNode(child, "category", NULL))
+			entry_add_category(e, xmlNodeGetContent(child));
+}
+
+static void
+rss_parse_enclosures(xmlNodePtr node, struct entry *e)
+{
 	for eachXmlElement(child, node) {
-		if (!xmlTestNode(child, "category", NULL))
+		if (!xmlTestNode(child, "enclosure", NULL))
 			continue;
-		if (!ARRAY_IN(e->categories, category))
-			break;
 
-		category->name = xmlNodeGetContent(child);
-		++category;
+		xmlChar *type = xmlGetNoNsProp(child, XML_CHAR "type");
+		if (!xmlStrncmp(type, XML_CHAR "image/", 6))
+			entry_add_image(e, xmlGetNoNsProp(child, XML_CHAR "url"));
+		xmlFree(type);
 	}
 }
 
@@ -73,8 +74,10 @@ rss_parse_item(xmlNodePtr node, struct entry const *feed)
 		.text = text,
 		.feed = feed,
 	};
+	entry_track(&entry);
 	rss_parse_authors(node, &entry);
 	rss_parse_category(node, &entry);
+	rss_parse_enclosures(node, &entry);
 
 	entry_process(&entry);
 
@@ -94,6 +97,7 @@ rss_parse_channel(xmlNodePtr node)
 		},
 		.feed = NULL,
 	};
+	entry_track(&feed);
 	rss_parse_category(node, &feed);
 
 	for eachXmlElement(child, node)
@@ -109,9 +113,13 @@ rss_parse(xmlNodePtr node)
 	if (!xmlTestNode(node, "rss", NULL))
 		return 0;
 
+	TRACE_BEGIN("rss_parse");
+
 	for eachXmlElement(child, node)
 		if (xmlTestNode(child, "channel", NULL))
 			rss_parse_channel(child);
 
+	TRACE_END();
+
 	return 1;
 }
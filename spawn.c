@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mrss.h"
+
+#define MAX_RUNNING 64
+
+/* Side channel of commands. */
+#define SIDE_FILENO 3
+
+/* Exit of commands is checked this often after their output ended. */
+#define REAP_INTERVAL_MS 100
+
+extern char **environ;
+
+struct running {
+	struct spawn_cmd *cmd;
+	pid_t pid;
+	/* -1 after end of output. */
+	int fd;
+	int side_fd;
+	int killed;
+	long long deadline;
+	/* Incomplete line of side channel. */
+	char side[1024];
+	size_t nside;
+};
+
+static long long
+clock_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Shell sets limits before it runs anything, so nothing started by command
+ * escapes them. Past the soft CPU limit command gets SIGXCPU, a second later
+ * SIGKILL.
+ */
+static char *
+limit_command(char const *command, struct spawn_limits const *limits)
+{
+	char prefix[128] = "";
+	size_t n = 0;
+	if (limits->cpu)
+		n += snprintf(prefix + n, sizeof prefix - n,
+				"ulimit -S -t %ld; ulimit -H -t %ld\n",
+				limits->cpu, limits->cpu + 1);
+	if (limits->memory)
+		n += snprintf(prefix + n, sizeof prefix - n,
+				"ulimit -v %lld\n", (limits->memory + 1023) / 1024);
+
+	char *ret;
+	if (asprintf(&ret, "%s%s", prefix, command) < 0)
+		return NULL;
+	return ret;
+}
+
+static int
+start(struct running *r, struct spawn_cmd *cmd,
+		struct spawn_limits const *limits,
+		struct spawn_handler const *handler)
+{
+	char *script = limit_command(cmd->command, limits);
+	if (!script) {
+		msg(LOG_WARNING, "Cannot allocate memory");
+		return 0;
+	}
+
+	int pipefd[2], sidefd[2] = { -1, -1 };
+	if (pipe2(pipefd, O_CLOEXEC)) {
+		msg(LOG_WARNING, "Cannot create pipe: %s", strerror(errno));
+		free(script);
+		return 0;
+	}
+	if (handler->line && pipe2(sidefd, O_CLOEXEC)) {
+		msg(LOG_WARNING, "Cannot create pipe: %s", strerror(errno));
+		close(pipefd[0]);
+		close(pipefd[1]);
+		free(script);
+		return 0;
+	}
+
+	/* Own process group so the whole pipeline can be killed. */
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+	if (0 <= sidefd[1])
+		posix_spawn_file_actions_adddup2(&actions, sidefd[1], SIDE_FILENO);
+
+	char *argv[] = { "sh", "-c", script, NULL };
+	int rc = posix_spawn(&r->pid, "/bin/sh", &actions, &attr, argv,
+			cmd->envp ? cmd->envp : environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	free(script);
+	close(pipefd[1]);
+	if (0 <= sidefd[1])
+		close(sidefd[1]);
+
+	if (rc) {
+		close(pipefd[0]);
+		if (0 <= sidefd[0])
+			close(sidefd[0]);
+		msg(LOG_WARNING, "Failed to execute command: %s", strerror(rc));
+		return 0;
+	}
+
+	r->cmd = cmd;
+	r->fd = pipefd[0];
+	r->side_fd = sidefd[0];
+	r->nside = 0;
+	r->killed = 0;
+	r->deadline = limits->timeout ? clock_ms() + limits->timeout * 1000LL : 0;
+	return 1;
+}
+
+static void
+stop(struct running *r)
+{
+	(void)kill(-r->pid, SIGKILL);
+	r->killed = 1;
+	if (0 <= r->fd)
+		close(r->fd);
+	r->fd = -1;
+	if (0 <= r->side_fd)
+		close(r->side_fd);
+	r->side_fd = -1;
+}
+
+/* Pass complete lines. Overlong lines are split. */
+static void
+read_side(struct running *r, struct spawn_handler const *handler)
+{
+	ssize_t n = read(r->side_fd, r->side + r->nside,
+			sizeof r->side - 1 - r->nside);
+	if (n <= 0) {
+		if (n < 0 && EINTR == errno)
+			return;
+		close(r->side_fd);
+		r->side_fd = -1;
+		if (r->nside) {
+			r->side[r->nside] = '\0';
+			handler->line(r->cmd, r->side);
+		}
+		r->nside = 0;
+		return;
+	}
+	r->nside += n;
+
+	char *s = r->side, *end = r->side + r->nside, *nl;
+	while ((nl = memchr(s, '\n', end - s))) {
+		*nl = '\0';
+		if (s < nl && '\r' == nl[-1])
+			nl[-1] = '\0';
+		handler->line(r->cmd, s);
+		s = nl + 1;
+	}
+	if (s == r->side && sizeof r->side - 1 == r->nside) {
+		*end = '\0';
+		handler->line(r->cmd, s);
+		s = end;
+	}
+	r->nside = end - s;
+	memmove(r->side, s, r->nside);
+}
+
+/* Return whether process has exited. */
+static int
+reap(struct running *r, struct spawn_handler const *handler)
+{
+	int status;
+	pid_t pid = waitpid(r->pid, &status, WNOHANG);
+	if (!pid)
+		return 0;
+	if (pid < 0)
+		status = W_EXITCODE(127, 0);
+	handler->done(r->cmd, status);
+	return 1;
+}
+
+void
+spawn_run(struct spawn_cmd *cmds, size_t ncmds, size_t parallel,
+		struct spawn_limits const *limits,
+		struct spawn_handler const *handler)
+{
+	struct running running[MAX_RUNNING];
+	/* Output and side channel of each command. */
+	struct pollfd fds[2 * MAX_RUNNING];
+	size_t nrunning = 0;
+	size_t next = 0;
+
+	if (!parallel)
+		parallel = 1;
+	if (MAX_RUNNING < parallel)
+		parallel = MAX_RUNNING;
+
+	while (next < ncmds || nrunning) {
+		while (nrunning < parallel && next < ncmds) {
+			struct spawn_cmd *cmd = &cmds[next++];
+			if (start(&running[nrunning], cmd, limits, handler))
+				++nrunning;
+			else
+				handler->done(cmd, W_EXITCODE(127, 0));
+		}
+
+		int timeout = -1;
+		long long now = clock_ms();
+		for (size_t i = 0; i < nrunning; ++i) {
+			struct running const *r = &running[i];
+			int t = -1;
+			if (r->deadline && !r->killed)
+				t = r->deadline < now ? 0 : r->deadline - now;
+			if (r->fd < 0 && r->side_fd < 0 &&
+			    (t < 0 || REAP_INTERVAL_MS < t))
+				t = REAP_INTERVAL_MS;
+			if (0 <= t && (timeout < 0 || t < timeout))
+				timeout = t;
+
+			fds[2 * i] = (struct pollfd){ .fd = r->fd, .events = POLLIN };
+			fds[2 * i + 1] = (struct pollfd){ .fd = r->side_fd, .events = POLLIN };
+		}
+
+		if (poll(fds, 2 * nrunning, timeout) < 0 && EINTR != errno)
+			msg(LOG_ERR, "Cannot poll commands: %s", strerror(errno));
+
+		now = clock_ms();
+		for (size_t i = 0; i < nrunning;) {
+			struct running *r = &running[i];
+
+			if (fds[2 * i + 1].revents && 0 <= r->side_fd)
+				read_side(r, handler);
+
+			if (fds[2 * i].revents && 0 <= r->fd) {
+				char buf[1 << 16];
+				ssize_t n = read(r->fd, buf, sizeof buf);
+				if (0 < n) {
+					if (!handler->output(r->cmd, buf, n))
+						stop(r);
+				} else if (!n || EINTR != errno) {
+					close(r->fd);
+					r->fd = -1;
+				}
+			}
+
+			if (!r->killed && r->deadline && r->deadline <= now) {
+				msg(LOG_WARNING, "Command timed out: %s", r->cmd->command);
+				stop(r);
+			}
+
+			if (r->fd < 0 && r->side_fd < 0 && reap(r, handler)) {
+				--nrunning;
+				running[i] = running[nrunning];
+				fds[2 * i] = fds[2 * nrunning];
+				fds[2 * i + 1] = fds[2 * nrunning + 1];
+				continue;
+			}
+			++i;
+		}
+	}
+}
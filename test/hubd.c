@@ -0,0 +1,216 @@
+/*
+ * Stand-in WebSub hub for testing.
+ *
+ * Usage: hubd PORT_FILE CONTENT
+ *
+ * Listens on a random local port that is written to PORT_FILE. Accepts one
+ * subscription request, verifies the callback, then pushes file CONTENT to it
+ * signed with the secret of the subscription. Exits with success if the
+ * subscriber went along.
+ */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../sha1.h"
+
+static char const CHALLENGE[] = "hubd-challenge";
+
+static void
+die(char const *s)
+{
+	fprintf(stderr, "hubd: %s\n", s);
+	exit(EXIT_FAILURE);
+}
+
+static void
+url_decode(char *s)
+{
+	char *d = s;
+	for (; *s; ++s) {
+		unsigned c;
+		if ('+' == *s) {
+			*d++ = ' ';
+		} else if ('%' == *s && 1 == sscanf(s + 1, "%2x", &c)) {
+			*d++ = c;
+			s += 2;
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+}
+
+static char *
+form_get(char *form, char const *key)
+{
+	size_t n = strlen(key);
+	for (char *s = strtok(form, "&"); s; s = strtok(NULL, "&"))
+		if (!strncmp(s, key, n) && '=' == s[n]) {
+			url_decode(s + n + 1);
+			return strdup(s + n + 1);
+		}
+	return NULL;
+}
+
+/* Read request or response head, then body of Content-Length. */
+static char *
+read_message(FILE *rx, char *first_line, size_t size)
+{
+	if (!fgets(first_line, size, rx))
+		die("Unexpected EOF");
+
+	char line[1024];
+	size_t content_length = 0;
+	while (fgets(line, sizeof line, rx) && strcmp(line, "\r\n"))
+		if (!strncasecmp(line, "Content-Length:", 15))
+			content_length = strtoul(line + 15, NULL, 10);
+
+	char *body = calloc(1, content_length + 1);
+	if (content_length != fread(body, 1, content_length, rx))
+		die("Truncated body");
+	return body;
+}
+
+/* Connect to http://HOST:PORT/PATH, retrying while subscriber starts up. */
+static FILE *
+connect_callback(char const *url, char const **path)
+{
+	char host[64];
+	int port;
+	int n;
+	if (2 != sscanf(url, "http://%63[^:/]:%d%n", host, &port, &n))
+		die("Invalid callback");
+	*path = url + n;
+
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+	};
+	inet_pton(AF_INET, host, &sin.sin_addr);
+
+	for (int tries = 0; tries < 100; ++tries) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (!connect(fd, (struct sockaddr *)&sin, sizeof sin))
+			return fdopen(fd, "r+");
+		close(fd);
+		usleep(100000);
+	}
+	die("Cannot connect to callback");
+	return NULL;
+}
+
+static void
+hmac_sha1_hex(char hex[2 * SHA1_BLOCK_SIZE + 1], char const *key,
+		char const *data, size_t size)
+{
+	BYTE k[64] = { 0 }, pad[64], inner[SHA1_BLOCK_SIZE], mac[SHA1_BLOCK_SIZE];
+	memcpy(k, key, strlen(key));
+
+	SHA1_CTX ctx;
+	for (int i = 0; i < 64; ++i)
+		pad[i] = k[i] ^ 0x36;
+	sha1_init(&ctx);
+	sha1_update(&ctx, pad, sizeof pad);
+	sha1_update(&ctx, (BYTE const *)data, size);
+	sha1_final(&ctx, inner);
+
+	for (int i = 0; i < 64; ++i)
+		pad[i] = k[i] ^ 0x5c;
+	sha1_init(&ctx);
+	sha1_update(&ctx, pad, sizeof pad);
+	sha1_update(&ctx, inner, sizeof inner);
+	sha1_final(&ctx, mac);
+
+	for (int i = 0; i < SHA1_BLOCK_SIZE; ++i)
+		sprintf(hex + 2 * i, "%02x", mac[i]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (3 != argc)
+		die("Usage: hubd PORT_FILE CONTENT");
+
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t sin_size = sizeof sin;
+	if (bind(server, (struct sockaddr *)&sin, sizeof sin) ||
+	    listen(server, 1) ||
+	    getsockname(server, (struct sockaddr *)&sin, &sin_size))
+		die("Cannot listen");
+
+	char tmp[4096];
+	snprintf(tmp, sizeof tmp, "%s.tmp", argv[1]);
+	FILE *f = fopen(tmp, "w");
+	fprintf(f, "%d\n", ntohs(sin.sin_port));
+	fclose(f);
+	rename(tmp, argv[1]);
+
+	/* Subscription request. */
+	FILE *client = fdopen(accept(server, NULL, NULL), "r+");
+	char line[1024];
+	char *form = read_message(client, line, sizeof line);
+	if (strncmp(line, "POST ", 5))
+		die("Subscription is not POST");
+	char *mode = form_get(strdup(form), "hub.mode");
+	char *topic = form_get(strdup(form), "hub.topic");
+	char *callback = form_get(strdup(form), "hub.callback");
+	char *secret = form_get(strdup(form), "hub.secret");
+	if (!mode || strcmp(mode, "subscribe") || !topic || !callback)
+		die("Invalid subscription request");
+	fputs("HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", client);
+	fclose(client);
+
+	/* Intent verification. */
+	char const *path;
+	FILE *cb = connect_callback(callback, &path);
+	fprintf(cb,
+			"GET %s?hub.mode=subscribe&hub.topic=%s&hub.challenge=%s&hub.lease_seconds=3600 HTTP/1.1\r\n"
+			"Connection: close\r\n"
+			"\r\n",
+			path, topic, CHALLENGE);
+	fflush(cb);
+	char *body = read_message(cb, line, sizeof line);
+	if (strncmp(line, "HTTP/1.1 200", 12) || strcmp(body, CHALLENGE))
+		die("Verification failed");
+	fclose(cb);
+
+	/* Content distribution. */
+	f = fopen(argv[2], "r");
+	static char content[1 << 20];
+	size_t content_size = fread(content, 1, sizeof content, f);
+	fclose(f);
+
+	char signature[2 * SHA1_BLOCK_SIZE + 1] = "";
+	if (secret)
+		hmac_sha1_hex(signature, secret, content, content_size);
+
+	cb = connect_callback(callback, &path);
+	fprintf(cb,
+			"POST %s HTTP/1.1\r\n"
+			"Content-Type: application/atom+xml\r\n"
+			"Content-Length: %zu\r\n"
+			"X-Hub-Signature: sha1=%s\r\n"
+			"Connection: close\r\n"
+			"\r\n",
+			path, content_size, signature);
+	fwrite(content, 1, content_size, cb);
+	fflush(cb);
+	read_message(cb, line, sizeof line);
+	if (strncmp(line, "HTTP/1.1 2", 10))
+		die("Push rejected");
+	fclose(cb);
+
+	return EXIT_SUCCESS;
+}
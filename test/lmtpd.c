@@ -0,0 +1,150 @@
+/*
+ * Minimal LMTP server for testing.
+ *
+ * Usage: lmtpd SOCKET DIRECTORY
+ *
+ * Delivered mails are stored as DIRECTORY/N with CRLF converted to LF.
+ *
+ * Environment:
+ * LMTPD_NOCHUNKING: Do not advertise CHUNKING.
+ * LMTPD_TEMPFAIL: Reject mails with 451.
+ * LMTPD_TEMPFAIL_MATCH: Reject mails containing this string with 451.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static char const *directory;
+static int nmails;
+static int tempfail;
+static char const *tempfail_match;
+
+static void
+save_mail(char const *data, size_t size)
+{
+	char path[4096];
+	snprintf(path, sizeof path, "%s/%d", directory, nmails++);
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < size; ++i)
+		if (!('\r' == data[i] && i + 1 < size && '\n' == data[i + 1]))
+			fputc(data[i], f);
+	fclose(f);
+}
+
+static void
+reply(FILE *tx, char const *s)
+{
+	fprintf(tx, "%s\r\n", s);
+	fflush(tx);
+}
+
+static void
+reply_delivery(FILE *tx, char const *data, size_t size)
+{
+	if (tempfail || (tempfail_match && memmem(data, size,
+			tempfail_match, strlen(tempfail_match)))) {
+		reply(tx, "451 4.3.0 Try again later");
+	} else {
+		save_mail(data, size);
+		reply(tx, "250 2.0.0 Delivered");
+	}
+}
+
+static void
+serve(int fd)
+{
+	FILE *rx = fdopen(fd, "r");
+	FILE *tx = fdopen(dup(fd), "w");
+
+	char *line = NULL;
+	size_t line_size = 0;
+	char *data = NULL;
+	size_t data_size = 0;
+
+	reply(tx, "220 localhost LMTP ready");
+
+	for (ssize_t n; 0 < (n = getline(&line, &line_size, rx));) {
+		while (0 < n && ('\r' == line[n - 1] || '\n' == line[n - 1]))
+			line[--n] = '\0';
+
+		if (!strncasecmp(line, "LHLO ", 5)) {
+			fputs("250-localhost\r\n", tx);
+			if (!getenv("LMTPD_NOCHUNKING"))
+				fputs("250-CHUNKING\r\n", tx);
+			reply(tx, "250 PIPELINING");
+		} else if (!strncasecmp(line, "MAIL FROM:", 10)) {
+			reply(tx, "250 2.1.0 OK");
+		} else if (!strncasecmp(line, "RCPT TO:", 8)) {
+			reply(tx, "250 2.1.5 OK");
+		} else if (!strncasecmp(line, "BDAT ", 5)) {
+			size_t size = strtoul(line + 5, NULL, 10);
+			data = realloc(data, size);
+			if (size != fread(data, 1, size, rx))
+				break;
+			reply_delivery(tx, data, size);
+		} else if (!strcasecmp(line, "DATA")) {
+			reply(tx, "354 Go ahead");
+			data_size = 0;
+			while (0 < (n = getline(&line, &line_size, rx))) {
+				if (!strcmp(line, ".\r\n"))
+					break;
+				char const *s = '.' == *line ? line + 1 : line;
+				size_t len = strlen(s);
+				data = realloc(data, data_size + len);
+				memcpy(data + data_size, s, len);
+				data_size += len;
+			}
+			reply_delivery(tx, data, data_size);
+		} else if (!strcasecmp(line, "QUIT")) {
+			reply(tx, "221 Bye");
+			break;
+		} else {
+			reply(tx, "500 5.5.1 Unknown command");
+		}
+	}
+
+	free(data);
+	free(line);
+	fclose(tx);
+	fclose(rx);
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (3 != argc) {
+		fprintf(stderr, "Usage: %s SOCKET DIRECTORY\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	directory = argv[2];
+	tempfail = !!getenv("LMTPD_TEMPFAIL");
+	tempfail_match = getenv("LMTPD_TEMPFAIL_MATCH");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strncpy(addr.sun_path, argv[1], sizeof addr.sun_path - 1);
+	unlink(addr.sun_path);
+
+	int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd < 0 ||
+	    bind(sfd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+	    listen(sfd, 8) < 0)
+	{
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	for (int fd; 0 <= (fd = accept(sfd, NULL, NULL));)
+		serve(fd);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,236 @@
+/*
+ * Allocation counter to be LD_PRELOAD-ed.
+ *
+ * Interposes malloc() and friends, and installs counting allocators into
+ * libxml2 using xmlMemSetup(). On exit, it appends a line to the file
+ * named by MEMCOUNT_OUTPUT (or standard error):
+ *
+ * peak=BYTES live=BYTES allocs=N xml_peak=BYTES xml_live=BYTES
+ *
+ * Sizes are usable sizes as reported by malloc_usable_size().
+ */
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+
+static long long live, peak, nallocs;
+static long long xml_live, xml_peak;
+
+/* dlsym() may allocate before real functions are known. */
+static char bootstrap[4096];
+static size_t bootstrap_used;
+
+static int
+is_bootstrap(void *p)
+{
+	return (char *)p >= bootstrap && (char *)p < bootstrap + sizeof bootstrap;
+}
+
+static void
+init(void)
+{
+	static int initializing;
+	if (real_malloc || initializing)
+		return;
+	initializing = 1;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+	real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+	real_memalign = dlsym(RTLD_NEXT, "memalign");
+	initializing = 0;
+}
+
+static void *
+bootstrap_alloc(size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	if (sizeof bootstrap - bootstrap_used < size)
+		abort();
+	void *p = bootstrap + bootstrap_used;
+	bootstrap_used += size;
+	return p;
+}
+
+static void *
+account(void *p)
+{
+	if (p) {
+		live += malloc_usable_size(p);
+		if (peak < live)
+			peak = live;
+		++nallocs;
+	}
+	return p;
+}
+
+static void
+unaccount(void *p)
+{
+	if (p)
+		live -= malloc_usable_size(p);
+}
+
+void *
+malloc(size_t size)
+{
+	init();
+	if (!real_malloc)
+		return bootstrap_alloc(size);
+	return account(real_malloc(size));
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	init();
+	if (!real_calloc)
+		/* Static memory is zeroed. */
+		return bootstrap_alloc(n * size);
+	return account(real_calloc(n, size));
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	init();
+	if (is_bootstrap(p)) {
+		void *q = malloc(size);
+		if (q)
+			memcpy(q, p, size);
+		return q;
+	}
+	size_t old = p ? malloc_usable_size(p) : 0;
+	void *q = real_realloc(p, size);
+	if (q || !size) {
+		live -= old;
+		if (q)
+			--nallocs;
+		account(q);
+	}
+	return q;
+}
+
+void
+free(void *p)
+{
+	init();
+	if (!p || is_bootstrap(p))
+		return;
+	unaccount(p);
+	real_free(p);
+}
+
+int
+posix_memalign(void **p, size_t alignment, size_t size)
+{
+	init();
+	int rc = real_posix_memalign(p, alignment, size);
+	if (!rc)
+		account(*p);
+	return rc;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	init();
+	return account(real_aligned_alloc(alignment, size));
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	init();
+	return account(real_memalign(alignment, size));
+}
+
+/* libxml2 allocations are counted twice: overall and separately. */
+
+static void *
+xml_account(void *p)
+{
+	if (p) {
+		xml_live += malloc_usable_size(p);
+		if (xml_peak < xml_live)
+			xml_peak = xml_live;
+	}
+	return p;
+}
+
+static void
+xml_free(void *p)
+{
+	if (p)
+		xml_live -= malloc_usable_size(p);
+	free(p);
+}
+
+static void *
+xml_malloc(size_t size)
+{
+	return xml_account(malloc(size));
+}
+
+static void *
+xml_realloc(void *p, size_t size)
+{
+	size_t old = p ? malloc_usable_size(p) : 0;
+	void *q = realloc(p, size);
+	if (q) {
+		xml_live -= old;
+		xml_account(q);
+	}
+	return q;
+}
+
+static char *
+xml_strdup(char const *s)
+{
+	size_t size = strlen(s) + 1;
+	char *p = xml_malloc(size);
+	if (p)
+		memcpy(p, s, size);
+	return p;
+}
+
+__attribute__((constructor))
+static void
+memcount_init(void)
+{
+	init();
+
+	int (*xml_mem_setup)(void (*)(void *), void *(*)(size_t),
+			void *(*)(void *, size_t), char *(*)(char const *)) =
+		dlsym(RTLD_DEFAULT, "xmlMemSetup");
+	if (xml_mem_setup)
+		xml_mem_setup(xml_free, xml_malloc, xml_realloc, xml_strdup);
+}
+
+__attribute__((destructor))
+static void
+memcount_report(void)
+{
+	char const *pathname = getenv("MEMCOUNT_OUTPUT");
+	FILE *f = pathname ? fopen(pathname, "a") : NULL;
+	fprintf(f ? f : stderr,
+			"peak=%lld live=%lld allocs=%lld xml_peak=%lld xml_live=%lld\n",
+			peak, live, nallocs, xml_peak, xml_live);
+	if (f)
+		fclose(f);
+}
@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+FILE *trace_stream;
+
+static char feed_id[32];
+static int depth;
+static pid_t pid;
+
+static long long
+trace_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+int
+trace_open(char const *pathname)
+{
+	trace_close();
+	if (!*pathname)
+		return 0;
+
+	trace_stream = fopen(pathname, "w");
+	if (!trace_stream)
+		return -1;
+
+	pid = getpid();
+	fprintf(trace_stream,
+			"[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"mrss\"}}",
+			pid, pid);
+	return 0;
+}
+
+void
+trace_close(void)
+{
+	if (!trace_stream)
+		return;
+
+	trace_unwind();
+	fputs("]\n", trace_stream);
+	fclose(trace_stream);
+	trace_stream = NULL;
+}
+
+void
+trace_set_feed(char const *id)
+{
+	strncpy(feed_id, id, sizeof feed_id - 1);
+}
+
+void
+trace_begin(char const *name)
+{
+	++depth;
+	fprintf(trace_stream,
+			",\n{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{\"feed\":\"%s\"}}",
+			name, trace_clock(), pid, pid, feed_id);
+}
+
+void
+trace_end(void)
+{
+	if (!depth)
+		return;
+	--depth;
+	fprintf(trace_stream,
+			",\n{\"ph\":\"E\",\"ts\":%lld,\"pid\":%d,\"tid\":%d}",
+			trace_clock(), pid, pid);
+}
+
+void
+trace_unwind(void)
+{
+	while (depth)
+		trace_end();
+}
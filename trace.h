@@ -0,0 +1,29 @@
+#ifndef MRSS_TRACE_H
+#define MRSS_TRACE_H
+
+#include <stdio.h>
+
+/* @see https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU */
+
+extern FILE *trace_stream;
+
+/* Tracing is off most of the time so keep it out of the hot path. */
+#define TRACE_ENABLED __builtin_expect(!!trace_stream, 0)
+
+#define TRACE_BEGIN(name) \
+	(TRACE_ENABLED ? trace_begin(name) : (void)0)
+#define TRACE_END() \
+	(TRACE_ENABLED ? trace_end() : (void)0)
+#define TRACE_UNWIND() \
+	(TRACE_ENABLED ? trace_unwind() : (void)0)
+
+int trace_open(char const *pathname);
+void trace_close(void);
+/* Subsequent spans are tagged with feed id. */
+void trace_set_feed(char const *id);
+void trace_begin(char const *name);
+void trace_end(void);
+/* End spans left open by an error. */
+void trace_unwind(void);
+
+#endif
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+static void *
+uring_mmap(int fd, size_t size, off_t offset)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, offset);
+	return MAP_FAILED == p ? NULL : p;
+}
+
+/* Returns negative errno on failure. */
+int
+uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof p);
+	memset(ring, 0, sizeof *ring);
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (IORING_FEAT_SINGLE_MMAP & p.features) {
+		if (ring->sq_ring_size < ring->cq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = uring_mmap(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+	ring->cq_ring = ring->cq_ring_size
+		? uring_mmap(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING)
+		: ring->sq_ring;
+	ring->sqes = uring_mmap(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+	if (!ring->sq_ring || !ring->cq_ring || !ring->sqes) {
+		int err = errno;
+		uring_exit(ring);
+		return -err;
+	}
+
+	char *sq = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	char *cq = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+void
+uring_exit(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	memset(ring, 0, sizeof *ring);
+	ring->fd = -1;
+}
+
+int
+uring_supports(struct uring *ring, unsigned char const *ops, size_t nops)
+{
+	size_t size = sizeof(struct io_uring_probe) +
+		256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (!probe)
+		return 0;
+
+	int ok = !syscall(__NR_io_uring_register, ring->fd,
+			IORING_REGISTER_PROBE, probe, 256);
+	for (size_t i = 0; ok && i < nops; ++i)
+		ok = ops[i] <= probe->last_op &&
+			(IO_URING_OP_SUPPORTED & probe->ops[ops[i]].flags);
+
+	free(probe);
+	return ok;
+}
+
+/* Returns zeroed SQE or NULL if submission queue is full. */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail + ring->sq_pending;
+	if (ring->sq_entries <= tail - head)
+		return NULL;
+
+	unsigned index = tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof *sqe);
+	ring->sq_array[index] = index;
+	++ring->sq_pending;
+	return sqe;
+}
+
+/* Returns negative errno on failure. */
+int
+uring_submit_and_wait(struct uring *ring, unsigned wait_nr)
+{
+	unsigned n = ring->sq_pending;
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + n, __ATOMIC_RELEASE);
+	ring->sq_pending = 0;
+
+	while (syscall(__NR_io_uring_enter, ring->fd, n, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+		if (EINTR != errno)
+			return -errno;
+
+	return 0;
+}
+
+/* Returns 1 and pops completion if there is any. */
+int
+uring_peek_cqe(struct uring *ring, struct io_uring_cqe *cqe)
+{
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	*cqe = ring->cqes[head & ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
@@ -0,0 +1,35 @@
+#ifndef MRSS_URING_H
+#define MRSS_URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/* Bare io_uring(7) rings. */
+struct uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_pending;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+int uring_supports(struct uring *ring, unsigned char const *ops, size_t nops);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+int uring_peek_cqe(struct uring *ring, struct io_uring_cqe *cqe);
+
+#endif
@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "mrss.h"
+
+/* @see https://www.w3.org/TR/websub/ */
+
+/* Larger pushes are rejected. */
+#define MAX_BODY_SIZE (16 << 20)
+
+static volatile sig_atomic_t stop;
+
+static void
+handle_stop(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int
+listen_on(char const *addr)
+{
+	char host[256];
+	char const *port = strrchr(addr, ':');
+	if (!port || sizeof host <= (size_t)(port - addr))
+		msg(LOG_ERR, "Invalid address: '%s'", addr);
+	memcpy(host, addr, port - addr);
+	host[port - addr] = '\0';
+	++port;
+
+	/* [::1]:80 */
+	char *h = host;
+	if ('[' == *h && ']' == h[strlen(h) - 1]) {
+		h[strlen(h) - 1] = '\0';
+		++h;
+	}
+
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *res;
+	int rc = getaddrinfo(*h ? h : NULL, port, &hints, &res);
+	if (rc)
+		msg(LOG_ERR, "Invalid address '%s': %s", addr, gai_strerror(rc));
+
+	int fd = -1;
+	for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 16))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	int err = errno;
+	freeaddrinfo(res);
+	if (fd < 0)
+		msg(LOG_ERR, "Cannot listen on '%s': %s", addr, strerror(err));
+	return fd;
+}
+
+static int
+hex_value(char c)
+{
+	if ('0' <= c && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if ('a' <= c && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* Decode application/x-www-form-urlencoded value in place. */
+static void
+url_decode(char *s)
+{
+	char *d = s;
+	for (; *s; ++s) {
+		if ('+' == *s) {
+			*d++ = ' ';
+		} else if ('%' == *s && 0 <= hex_value(s[1]) && 0 <= hex_value(s[2])) {
+			*d++ = hex_value(s[1]) * 16 + hex_value(s[2]);
+			s += 2;
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+}
+
+struct query {
+	char const *mode;
+	char const *topic;
+	char const *challenge;
+	char const *lease_seconds;
+	char const *reason;
+};
+
+/* Split query string in place. */
+static void
+query_parse(struct query *q, char *s)
+{
+	while (s && *s) {
+		char *key = s;
+		s = strchr(s, '&');
+		if (s)
+			*s++ = '\0';
+
+		char *value = strchr(key, '=');
+		if (!value)
+			continue;
+		*value++ = '\0';
+		url_decode(value);
+
+		if (!strcmp(key, "hub.mode"))
+			q->mode = value;
+		else if (!strcmp(key, "hub.topic"))
+			q->topic = value;
+		else if (!strcmp(key, "hub.challenge"))
+			q->challenge = value;
+		else if (!strcmp(key, "hub.lease_seconds"))
+			q->lease_seconds = value;
+		else if (!strcmp(key, "hub.reason"))
+			q->reason = value;
+	}
+}
+
+static void
+reply(FILE *tx, char const *status, char const *body)
+{
+	fprintf(tx,
+			"HTTP/1.1 %s\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n"
+			"\r\n"
+			"%s",
+			status, strlen(body), body);
+	fflush(tx);
+}
+
+static void
+handle(int fd, struct websub_handler const *handler)
+{
+	/* Stalled clients must not block others forever. */
+	struct timeval timeout = { .tv_sec = 10 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+	FILE *rx = fdopen(fd, "r");
+	FILE *tx = fdopen(dup(fd), "w");
+	char *body = NULL;
+	if (!rx || !tx)
+		goto out;
+
+	char line[8192], method[8], target[sizeof line];
+	if (!fgets(line, sizeof line, rx) ||
+	    2 != sscanf(line, "%7s %8191s", method, target))
+		goto out;
+
+	size_t content_length = 0;
+	char signature[128] = "";
+	while (fgets(line, sizeof line, rx) &&
+	       strcmp(line, "\r\n") && strcmp(line, "\n"))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!strncasecmp(line, "Content-Length:", 15))
+			content_length = strtoull(line + 15, NULL, 10);
+		else if (!strncasecmp(line, "X-Hub-Signature:", 16))
+			snprintf(signature, sizeof signature, "%s",
+					line + 16 + strspn(line + 16, " \t"));
+	}
+
+	/* Callback is "/ID". */
+	char *query = strchr(target, '?');
+	if (query)
+		*query++ = '\0';
+	char const *id = target + ('/' == *target);
+
+	if (!strcmp(method, "GET")) {
+		struct query q = { 0 };
+		query_parse(&q, query);
+		/* Denial is a notice without challenge. */
+		int denied = q.mode && !strcmp(q.mode, "denied");
+		if (denied && q.topic)
+			msg(LOG_WARNING, "WebSub: Subscription to %s denied: %s",
+					q.topic, q.reason ? q.reason : "No reason given");
+		if (!q.mode || !q.topic || (!q.challenge && !denied))
+			reply(tx, "400 Bad Request", "");
+		else if (handler->verify(id, q.mode, q.topic,
+		                         q.lease_seconds ? atol(q.lease_seconds) : 0))
+			reply(tx, "200 OK", q.challenge ? q.challenge : "");
+		else
+			reply(tx, "404 Not Found", "");
+	} else if (!strcmp(method, "POST")) {
+		if (MAX_BODY_SIZE < content_length) {
+			reply(tx, "413 Payload Too Large", "");
+			goto out;
+		}
+		body = malloc(content_length + 1);
+		if (!body || content_length != fread(body, 1, content_length, rx)) {
+			reply(tx, "400 Bad Request", "");
+			goto out;
+		}
+		body[content_length] = '\0';
+		/* Hub should not wait for processing. */
+		reply(tx, "202 Accepted", "");
+		fclose(tx);
+		tx = NULL;
+		handler->push(id, body, content_length, signature);
+	} else {
+		reply(tx, "405 Method Not Allowed", "");
+	}
+
+out:
+	free(body);
+	if (tx)
+		fclose(tx);
+	if (rx)
+		fclose(rx);
+	else
+		close(fd);
+}
+
+void
+websub_serve(char const *addr, struct websub_handler const *handler)
+{
+	int fd = listen_on(addr);
+	msg(LOG_INFO, "Listening on %s", addr);
+
+	/* Interrupt accept() so the run can finish normally. */
+	struct sigaction sa = { .sa_handler = handle_stop };
+	struct sigaction old_int, old_term;
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (stop = 0; !stop;) {
+		int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (0 <= client)
+			handle(client, handler);
+		else if (EINTR != errno && ECONNABORTED != errno)
+			msg(LOG_WARNING, "Cannot accept connection: %s", strerror(errno));
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	close(fd);
+	msg(LOG_INFO, "Stopped listening on %s", addr);
+}